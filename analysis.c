@@ -0,0 +1,277 @@
+// ========================================================================
+//
+//  Project   : statsproxy 
+//
+//  Version   : 1.0
+//
+//  Copyright :
+//
+//      Software License Agreement (BSD License)
+//
+//      Copyright (c) 2009, Gear Six, Inc.
+//      All rights reserved.
+//
+//      Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are
+//      met:
+//
+//      * Redistributions of source code must retain the above copyright
+//        notice, this list of conditions and the following disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following disclaimer
+//        in the documentation and/or other materials provided with the
+//        distribution.
+//
+//      * Neither the name of Gear Six, Inc. nor the names of its
+//        contributors may be used to endorse or promote products derived from
+//        this software without specific prior written permission.The Gear Six logo, 
+//        which is provided in the source code and appears on the user interface 
+//        to identify Gear Six, Inc. as the originator of the software program, is 
+//        a trademark of Gear Six, Inc. and can be used only in unaltered form and 
+//        only for purposes of such identification.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// ========================================================================
+//
+#include <stdio.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+
+#include "queue.h"
+#include "statsproxy.h"
+#include "proxylog.h"
+#include "analysis.h"
+
+static struct uri_entry *
+findUri(backend_t *bep, const char *uri)
+{
+    struct uri_entry *uri_entry;
+
+    TAILQ_FOREACH(uri_entry, &bep->uris, next) {
+        if (strcmp(uri_entry->uri, uri) == 0) {
+            return uri_entry;
+        }
+    }
+    return NULL;
+}
+
+// a cell of the matrix, 0 when the field isn't there
+static uint64_t
+cell(struct slab_matrix *m, int f, int r)
+{
+    return (f >= 0) ? m->vals[f * m->nslabs + r] : 0;
+}
+
+// plain numbers only
+static bool_t
+numericValue(const char *str, uint64_t *val)
+{
+    size_t len = strspn(str, "0123456789");
+
+    if (len == 0 || len >= 20 || str[len] != '\0') {
+        return FALSE;
+    }
+    *val = strtoull(str, NULL, 10);
+    return TRUE;
+}
+
+// spread the "stats sizes" histogram (item count per 32 byte size) over
+// the slab classes - each size lands in the smallest class whose chunks
+// hold it. Sizes are rounded up, so the waste is an underestimate.
+static bool_t
+sizesWaste(struct slab_analysis *a, struct uri_entry *sizes)
+{
+    struct stats_entry *entry;
+    uint64_t           size;
+    uint64_t           count;
+    int                r = 0;
+    int                i;
+
+    if (sizes == NULL || sizes->stats->count == 0) {
+        return FALSE;
+    }
+    for (i = 0; i < sizes->stats->count; i++) {
+        entry = &sizes->stats->entries[i];
+        if (!numericValue(entry->name, &size)) {
+            continue;
+        }
+        if (entry->type == UINT64) {
+            count = entry->v.value;
+        } else if (!numericValue(entry->v.valueStr, &count)) {
+            continue;
+        }
+        for (r = 0; r < a->nclasses && a->classes[r].chunkSize < size; r++) {
+        }
+        if (r == a->nclasses) {
+            continue; // larger than any chunk
+        }
+        a->classes[r].requested += count * size;
+        a->classes[r].wasted += count * (a->classes[r].chunkSize - size);
+    }
+    return TRUE;
+}
+
+// bytes of a class not holding item data - what ranks its problems after
+// evictions
+static uint64_t
+idleBytes(struct slab_class *c)
+{
+    return c->wasted + (c->totalChunks - c->usedChunks) * c->chunkSize;
+}
+
+// is class a a worse problem than class b
+static bool_t
+worse(struct slab_class *a, struct slab_class *b)
+{
+    if (a->evictRate != b->evictRate) {
+        return a->evictRate > b->evictRate;
+    }
+    return idleBytes(a) > idleBytes(b);
+}
+
+void
+analysis_update(backend_t *bep, uint64_t now)
+{
+    struct uri_entry     *slabs = findUri(bep, "slabs");
+    struct uri_entry     *items = findUri(bep, "items");
+    struct slab_matrix   *m;
+    struct slab_matrix   *im = NULL;
+    struct slab_analysis *a;
+    struct slab_class    *c;
+    uint64_t             dt;
+    uint64_t             evicted;
+    uint64_t             hits;
+    int                  fChunk;
+    int                  fPages;
+    int                  fTotal;
+    int                  fUsed;
+    int                  fHits;
+    int                  fRequested;
+    int                  fNumber = -1;
+    int                  fEvicted = -1;
+    int                  ir = 0;
+    int                  r;
+    int                  i;
+    int                  j;
+
+    if (slabs == NULL || slabs->published_ms != now ||
+        (m = slabs->stats->slabs) == NULL) {
+        return;
+    }
+    if (bep->analysis == NULL) {
+        bep->analysis = (struct slab_analysis *) calloc(1, sizeof *a);
+        alloc_fail_check(bep->analysis);
+    }
+    a = bep->analysis;
+    fChunk = slab_field(m, "chunk_size");
+    fPages = slab_field(m, "total_pages");
+    fTotal = slab_field(m, "total_chunks");
+    fUsed = slab_field(m, "used_chunks");
+    fHits = slab_field(m, "get_hits");
+    fRequested = slab_field(m, "mem_requested");
+    if (items != NULL && (im = items->stats->slabs) != NULL) {
+        fNumber = slab_field(im, "number");
+        fEvicted = slab_field(im, "evicted");
+    }
+    dt = (a->lastStamp != 0 && now > a->lastStamp) ? now - a->lastStamp : 0;
+
+    a->stamp = now;
+    a->nclasses = m->nslabs;
+    a->memory = a->used = a->wasted = 0;
+    for (r = 0; r < m->nslabs; r++) {
+        c = &a->classes[r];
+        memset(c, 0, sizeof *c);
+        c->slab = m->slab[r];
+        c->chunkSize = cell(m, fChunk, r);
+        c->pages = cell(m, fPages, r);
+        c->totalChunks = cell(m, fTotal, r);
+        c->usedChunks = cell(m, fUsed, r);
+        c->requested = cell(m, fRequested, r);
+        c->fill = c->totalChunks ?
+                  (double) c->usedChunks / c->totalChunks : 0;
+
+        // the class's items row - both matrices are in slab class order
+        evicted = 0;
+        while (im != NULL && ir < im->nslabs && im->slab[ir] < c->slab) {
+            ir++;
+        }
+        if (im != NULL && ir < im->nslabs && im->slab[ir] == c->slab) {
+            c->items = cell(im, fNumber, ir);
+            evicted = cell(im, fEvicted, ir);
+        }
+        hits = cell(m, fHits, r);
+        if (dt > 0 && evicted >= a->lastEvicted[c->slab]) {
+            c->evictRate = (double) (evicted - a->lastEvicted[c->slab]) *
+                           NUM_MSECS_PER_SEC / dt;
+        }
+        if (dt > 0 && hits >= a->lastHits[c->slab]) {
+            c->hitRate = (double) (hits - a->lastHits[c->slab]) *
+                         NUM_MSECS_PER_SEC / dt;
+        }
+        a->lastEvicted[c->slab] = evicted;
+        a->lastHits[c->slab] = hits;
+    }
+    a->lastStamp = now;
+
+    // internal fragmentation - exact from mem_requested (memcached 1.4.1+),
+    // else estimated from the item sizes
+    if (fRequested >= 0) {
+        a->source = WASTE_REQUESTED;
+        for (r = 0; r < a->nclasses; r++) {
+            c = &a->classes[r];
+            if (c->usedChunks * c->chunkSize > c->requested) {
+                c->wasted = c->usedChunks * c->chunkSize - c->requested;
+            }
+        }
+    } else if (sizesWaste(a, findUri(bep, "sizes"))) {
+        a->source = WASTE_SIZES;
+    } else {
+        a->source = WASTE_NONE;
+    }
+
+    // problems, ranked by eviction rate then by idle bytes
+    a->nranked = 0;
+    for (r = 0; r < a->nclasses; r++) {
+        c = &a->classes[r];
+        a->memory += c->totalChunks * c->chunkSize;
+        a->used += c->usedChunks * c->chunkSize;
+        a->wasted += c->wasted;
+        if (c->evictRate > 0) {
+            c->problems |= SLAB_EVICTING;
+        }
+        if (c->usedChunks > 0 && c->wasted >=
+            SLAB_WASTE_RATIO * c->usedChunks * c->chunkSize) {
+            c->problems |= SLAB_FRAGMENTED;
+        }
+        if (c->pages > 1 && c->fill < SLAB_FILL_RATIO) {
+            c->problems |= SLAB_UNDERUSED;
+        }
+        if (c->problems == 0) {
+            continue;
+        }
+        for (i = a->nranked; i > 0 && worse(c, &a->classes[a->ranked[i - 1]]);
+             i--) {
+        }
+        for (j = a->nranked; j > i; j--) {
+            a->ranked[j] = a->ranked[j - 1];
+        }
+        a->ranked[i] = r;
+        a->nranked++;
+    }
+}
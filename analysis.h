@@ -0,0 +1,112 @@
+// ========================================================================
+//
+//  Project   : statsproxy 
+//
+//  Version   : 1.0
+//
+//  Copyright :
+//
+//      Software License Agreement (BSD License)
+//
+//      Copyright (c) 2009, Gear Six, Inc.
+//      All rights reserved.
+//
+//      Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are
+//      met:
+//
+//      * Redistributions of source code must retain the above copyright
+//        notice, this list of conditions and the following disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following disclaimer
+//        in the documentation and/or other materials provided with the
+//        distribution.
+//
+//      * Neither the name of Gear Six, Inc. nor the names of its
+//        contributors may be used to endorse or promote products derived from
+//        this software without specific prior written permission.The Gear Six logo, 
+//        which is provided in the source code and appears on the user interface 
+//        to identify Gear Six, Inc. as the originator of the software program, is 
+//        a trademark of Gear Six, Inc. and can be used only in unaltered form and 
+//        only for purposes of such identification.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// ========================================================================
+//
+
+#ifndef _ANALYSIS_H
+#define _ANALYSIS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// a slab class wasting at least this share of its used chunk memory to
+// fragmentation, or using less than this share of its chunks, is listed
+// as a problem
+#define SLAB_WASTE_RATIO 0.2
+#define SLAB_FILL_RATIO  0.5
+
+// where the fragmentation estimate came from
+enum waste_source { WASTE_NONE, WASTE_REQUESTED, WASTE_SIZES };
+
+// problems of a slab class
+#define SLAB_EVICTING    0x1               // evicting items
+#define SLAB_FRAGMENTED  0x2               // chunks much larger than items
+#define SLAB_UNDERUSED   0x4               // pages of mostly free chunks
+
+// one slab class
+struct slab_class {
+    int                        slab;           // slab class
+    uint64_t                   chunkSize;      // bytes per chunk
+    uint64_t                   pages;          // pages assigned
+    uint64_t                   totalChunks;    // chunks in the pages
+    uint64_t                   usedChunks;     // chunks holding items
+    uint64_t                   items;          // items stored
+    uint64_t                   requested;      // bytes the items asked for
+    uint64_t                   wasted;         // used chunk bytes not asked for
+    double                     fill;           // used / total chunks
+    double                     evictRate;      // evictions per second
+    double                     hitRate;        // get hits per second
+    int                        problems;       // SLAB_ bits
+};
+
+// a backend's slab analysis, redone every poll of its "slabs" uri
+struct slab_analysis {
+    uint64_t                   stamp;          // publish time (ms)
+    enum waste_source          source;         // of the requested bytes
+    uint64_t                   memory;         // bytes in chunks
+    uint64_t                   used;           // bytes in used chunks
+    uint64_t                   wasted;         // of those, not asked for
+    int                        nclasses;       // slab classes
+    struct slab_class          classes[MAX_SLAB_CLASSES];
+    int                        nranked;        // classes with problems
+    int                        ranked[MAX_SLAB_CLASSES]; // worst first
+
+    // counters of the last poll, for the rates
+    uint64_t                   lastStamp;
+    uint64_t                   lastEvicted[MAX_SLAB_CLASSES];
+    uint64_t                   lastHits[MAX_SLAB_CLASSES];
+};
+
+// analyse a backend's freshly published slabs, items and sizes stats
+// (called by its poller with the backend write locked); now is the publish
+// time in ms
+void analysis_update(backend_t *bep, uint64_t now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _ANALYSIS_H */
@@ -0,0 +1,102 @@
+// ========================================================================
+//
+//  Project   : statsproxy 
+//
+//  Version   : 1.0
+//
+//  Copyright :
+//
+//      Software License Agreement (BSD License)
+//
+//      Copyright (c) 2009, Gear Six, Inc.
+//      All rights reserved.
+//
+//      Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are
+//      met:
+//
+//      * Redistributions of source code must retain the above copyright
+//        notice, this list of conditions and the following disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following disclaimer
+//        in the documentation and/or other materials provided with the
+//        distribution.
+//
+//      * Neither the name of Gear Six, Inc. nor the names of its
+//        contributors may be used to endorse or promote products derived from
+//        this software without specific prior written permission.The Gear Six logo, 
+//        which is provided in the source code and appears on the user interface 
+//        to identify Gear Six, Inc. as the originator of the software program, is 
+//        a trademark of Gear Six, Inc. and can be used only in unaltered form and 
+//        only for purposes of such identification.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// ========================================================================
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+
+#include "queue.h"
+#include "statsproxy.h"
+#include "proxylog.h"
+#include "chunked.h"
+
+// chunk payloads are gathered up to this size before going out
+#define CHUNK_BUFSZ 16384
+
+static ssize_t
+chunkedWrite(void *cookie, const char *buf, size_t size)
+{
+    FILE *sock = (FILE *) cookie;
+
+    if (size == 0) {
+        return 0;
+    }
+    if (fprintf(sock, "%zx\r\n", size) < 0 ||
+        fwrite(buf, size, 1, sock) != 1 ||
+        fputs("\r\n", sock) == EOF) {
+        return -1;
+    }
+    return size;
+}
+
+static int
+chunkedClose(void *cookie)
+{
+    FILE *sock = (FILE *) cookie;
+
+    fputs("0\r\n\r\n", sock);
+    return fflush(sock) == EOF ? -1 : 0;
+}
+
+FILE *
+chunked_open(FILE *sock)
+{
+    cookie_io_functions_t io;
+    FILE                  *fp;
+
+    memset(&io, 0, sizeof io);
+    io.write = chunkedWrite;
+    io.close = chunkedClose;
+    fp = fopencookie(sock, "w", io);
+    alloc_fail_check(fp);
+    setvbuf(fp, NULL, _IOFBF, CHUNK_BUFSZ);
+    return fp;
+}
@@ -0,0 +1,472 @@
+// ========================================================================
+//
+//  Project   : statsproxy 
+//
+//  Version   : 1.0
+//
+//  Copyright :
+//
+//      Software License Agreement (BSD License)
+//
+//      Copyright (c) 2009, Gear Six, Inc.
+//      All rights reserved.
+//
+//      Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are
+//      met:
+//
+//      * Redistributions of source code must retain the above copyright
+//        notice, this list of conditions and the following disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following disclaimer
+//        in the documentation and/or other materials provided with the
+//        distribution.
+//
+//      * Neither the name of Gear Six, Inc. nor the names of its
+//        contributors may be used to endorse or promote products derived from
+//        this software without specific prior written permission.The Gear Six logo, 
+//        which is provided in the source code and appears on the user interface 
+//        to identify Gear Six, Inc. as the originator of the software program, is 
+//        a trademark of Gear Six, Inc. and can be used only in unaltered form and 
+//        only for purposes of such identification.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// ========================================================================
+//
+#include <stdio.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "queue.h"
+#include "statsproxy.h"
+#include "proxylog.h"
+#include "cluster.h"
+#include "sketch.h"
+
+// one numeric stat across the members.  Sums are kept up to date as each
+// member's value changes; min/max only need a rescan of the members when
+// the member holding the extreme moves away from it.  Rates are kept in
+// thousandths per second so their sums stay exact.
+struct agg_stat {
+    char                       *name;          // stat name
+    int                        n;              // members reporting it
+    bool_t                     dirty;          // extremes need a rescan
+    uint64_t                   sum;            // sum of values
+    uint64_t                   min;            // smallest value
+    uint64_t                   max;            // largest value
+    uint64_t                   rateSum;        // sum of member rates
+    uint64_t                   rateMax;        // largest member rate
+    uint64_t                   *vals;          // value per member
+    uint64_t                   *rates;         // rate per member
+    uint64_t                   *seen;          // fold pass per member (0: none)
+};
+
+// one stats uri across the members
+struct agg_uri {
+    struct uri_entry           *entry;         // cluster's own uri
+    int                        nstats;         // number of stats
+    int                        size;           // size of stats
+    struct agg_stat            **stats;        // stats sorted by name
+    struct agg_stat            *known[NUM_KNOWN_STATS]; // by schema slot
+    uint64_t                   *generation;    // member uri generation folded
+    uint64_t                   *stamp;         // member uri publish time
+};
+
+struct cluster {
+    backend_t                  *bep;           // the cluster backend
+    int                        nmembers;       // number of members
+    backend_t                  **members;      // member backends
+    int                        nuris;          // number of uris
+    struct agg_uri             *uris;          // aggregated uris
+    uint64_t                   pass;           // fold pass counter
+};
+
+// plain counters and gauges only - versions, times and floats are skipped
+static bool_t
+numericValue(struct stats_entry *entry, uint64_t *val)
+{
+    size_t len;
+
+    if (entry->type == UINT64) {
+        *val = entry->v.value;
+        return TRUE;
+    }
+    len = strspn(entry->v.valueStr, "0123456789");
+    if (len == 0 || len >= 20 || entry->v.valueStr[len] != '\0') {
+        return FALSE;
+    }
+    *val = strtoull(entry->v.valueStr, NULL, 10);
+    return TRUE;
+}
+
+// find a stat, adding it in name order the first time it shows up
+static struct agg_stat *
+findAggStat(struct cluster *cl, struct agg_uri *au, const char *name)
+{
+    struct agg_stat *s;
+    int             lo = 0;
+    int             hi = au->nstats;
+    int             mid;
+    int             cmp;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        cmp = strcmp(au->stats[mid]->name, name);
+        if (cmp == 0) {
+            return au->stats[mid];
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (au->nstats == au->size) {
+        au->size = au->size ? au->size * 2 : 64;
+        au->stats = (struct agg_stat **)
+            realloc(au->stats, au->size * sizeof *au->stats);
+        alloc_fail_check(au->stats);
+    }
+    s = (struct agg_stat *) calloc(1, sizeof *s);
+    alloc_fail_check(s);
+    s->name = strdup(name);
+    alloc_fail_check(s->name);
+    s->vals = (uint64_t *) calloc(cl->nmembers, sizeof *s->vals);
+    alloc_fail_check(s->vals);
+    s->rates = (uint64_t *) calloc(cl->nmembers, sizeof *s->rates);
+    alloc_fail_check(s->rates);
+    s->seen = (uint64_t *) calloc(cl->nmembers, sizeof *s->seen);
+    alloc_fail_check(s->seen);
+    memmove(&au->stats[lo + 1], &au->stats[lo],
+            (au->nstats - lo) * sizeof *au->stats);
+    au->stats[lo] = s;
+    au->nstats++;
+    return s;
+}
+
+// take a member's value (and rate) for a stat
+static void
+aggSet(struct agg_stat *s, int m, uint64_t val, uint64_t rate)
+{
+    uint64_t old;
+    uint64_t oldRate;
+
+    if (s->seen[m] != 0) {
+        old = s->vals[m];
+        oldRate = s->rates[m];
+        s->sum -= old;
+        s->rateSum -= oldRate;
+        if ((old == s->max && val < old) || (old == s->min && val > old) ||
+            (oldRate == s->rateMax && rate < oldRate)) {
+            s->dirty = TRUE;
+        }
+    } else {
+        s->n++;
+    }
+    s->vals[m] = val;
+    s->rates[m] = rate;
+    s->sum += val;
+    s->rateSum += rate;
+    if (s->n == 1) {
+        s->min = s->max = val;
+        s->rateMax = rate;
+        s->dirty = FALSE;
+    } else if (!s->dirty) {
+        s->max = (val > s->max) ? val : s->max;
+        s->min = (val < s->min) ? val : s->min;
+        s->rateMax = (rate > s->rateMax) ? rate : s->rateMax;
+    }
+}
+
+// a member stopped reporting a stat
+static void
+aggDrop(struct agg_stat *s, int m)
+{
+    s->sum -= s->vals[m];
+    s->rateSum -= s->rates[m];
+    s->n--;
+    if (s->vals[m] == s->max || s->vals[m] == s->min ||
+        s->rates[m] == s->rateMax) {
+        s->dirty = TRUE;
+    }
+    s->seen[m] = 0;
+}
+
+static void
+aggRescan(struct cluster *cl, struct agg_stat *s)
+{
+    int    m;
+    bool_t first = TRUE;
+
+    for (m = 0; m < cl->nmembers; m++) {
+        if (s->seen[m] == 0) {
+            continue;
+        }
+        if (first || s->vals[m] > s->max) {
+            s->max = s->vals[m];
+        }
+        if (first || s->vals[m] < s->min) {
+            s->min = s->vals[m];
+        }
+        if (first || s->rates[m] > s->rateMax) {
+            s->rateMax = s->rates[m];
+        }
+        first = FALSE;
+    }
+    s->dirty = FALSE;
+}
+
+// forget everything a member contributed to a uri
+static void
+dropMember(struct agg_uri *au, int m)
+{
+    int i;
+
+    for (i = 0; i < au->nstats; i++) {
+        if (au->stats[i]->seen[m] != 0) {
+            aggDrop(au->stats[i], m);
+        }
+    }
+    au->generation[m] = 0;
+    au->stamp[m] = 0;
+}
+
+// fold a member's uri into the aggregates - only stats of a snapshot the
+// cluster hasn't seen yet are touched (called with the member read locked)
+static void
+foldMember(struct cluster *cl, struct agg_uri *au, int m,
+           struct uri_entry *entry)
+{
+    struct stats_entry *stat;
+    struct agg_stat    *s;
+    uint64_t           pass;
+    uint64_t           val;
+    uint64_t           rate;
+    uint64_t           dt;
+    int                i;
+
+    if (entry->generation == au->generation[m] || entry->generation == 0) {
+        return;
+    }
+    dt = (au->stamp[m] != 0) ? entry->published_ms - au->stamp[m] : 0;
+    pass = ++cl->pass;
+    for (i = 0; i < entry->stats->count; i++) {
+        stat = &entry->stats->entries[i];
+        if (!numericValue(stat, &val)) {
+            continue;
+        }
+        if (stat->known < 0) {
+            s = findAggStat(cl, au, stat->name);
+        } else if ((s = au->known[stat->known]) == NULL) {
+            s = au->known[stat->known] = findAggStat(cl, au, stat->name);
+        }
+        rate = 0;
+        if (s->seen[m] != 0 && dt > 0 && val >= s->vals[m]) {
+            rate = (val - s->vals[m]) * 1000 * NUM_MSECS_PER_SEC / dt;
+        }
+        aggSet(s, m, val, rate);
+        s->seen[m] = pass;
+    }
+    for (i = 0; i < au->nstats; i++) {
+        s = au->stats[i];
+        if (s->seen[m] != 0 && s->seen[m] != pass) {
+            aggDrop(s, m);
+        }
+    }
+    au->generation[m] = entry->generation;
+    au->stamp[m] = entry->published_ms;
+}
+
+static void
+addStat(struct stats_builder *b, const char *name, const char *suffix,
+        uint64_t val)
+{
+    char statName[MAXREQSZ];
+
+    snprintf(statName, sizeof statName, "%s%s", name, suffix);
+    stats_add(b, statName, UINT64, NULL, val);
+}
+
+static void
+addRateStat(struct stats_builder *b, const char *name, const char *suffix,
+            uint64_t milli)
+{
+    char statName[MAXREQSZ];
+    char valueStr[32];
+
+    snprintf(statName, sizeof statName, "%s%s", name, suffix);
+    snprintf(valueStr, sizeof valueStr, "%"PRIu64".%03"PRIu64, milli / 1000,
+             milli % 1000);
+    stats_add(b, statName, ALPHA, valueStr, 0);
+}
+
+// the cluster's stats for a uri: member count, then per stat the sum,
+// extremes, average, summed rate and largest member rate, and the hit
+// ratio when the uri has get hits and misses
+static void
+buildStats(struct cluster *cl, struct agg_uri *au, int polling,
+           struct stats_builder *stats)
+{
+    struct agg_stat    *s;
+    struct agg_stat    *hits = au->known[KNOWN_get_hits];
+    struct agg_stat    *misses = au->known[KNOWN_get_misses];
+    char               ratio[32];
+    int                i;
+
+    addStat(stats, "backends", "", polling);
+    for (i = 0; i < au->nstats; i++) {
+        s = au->stats[i];
+        if (s->n == 0) {
+            continue;
+        }
+        if (s->dirty) {
+            aggRescan(cl, s);
+        }
+        addStat(stats, s->name, "", s->sum);
+        addStat(stats, s->name, CLUSTER_MIN, s->min);
+        addStat(stats, s->name, CLUSTER_MAX, s->max);
+        addStat(stats, s->name, CLUSTER_AVG, s->sum / s->n);
+        addRateStat(stats, s->name, CLUSTER_RATE, s->rateSum);
+        addRateStat(stats, s->name, CLUSTER_RATE_MAX, s->rateMax);
+    }
+    if (hits != NULL && misses != NULL && hits->n > 0 && misses->n > 0 &&
+        hits->sum + misses->sum > 0) {
+        snprintf(ratio, sizeof ratio, "%.4f",
+                 (double) hits->sum / (double) (hits->sum + misses->sum));
+        stats_add(stats, "hit_ratio", ALPHA, ratio, 0);
+    }
+}
+
+struct cluster *
+cluster_new(backend_t *bep, struct backend_entries *proxies)
+{
+    struct cluster   *cl;
+    struct uri_entry *entry;
+    backend_t        *member;
+    int              i;
+
+    cl = (struct cluster *) calloc(1, sizeof *cl);
+    alloc_fail_check(cl);
+    cl->bep = bep;
+
+    TAILQ_FOREACH(member, proxies, next) {
+        if (bep->settings.pool == NULL ||
+            (member->settings.pool != NULL &&
+             strcmp(member->settings.pool, bep->settings.pool) == 0)) {
+            cl->nmembers++;
+        }
+    }
+    cl->members = (backend_t **) calloc(cl->nmembers + 1, sizeof *cl->members);
+    alloc_fail_check(cl->members);
+    i = 0;
+    TAILQ_FOREACH(member, proxies, next) {
+        if (bep->settings.pool == NULL ||
+            (member->settings.pool != NULL &&
+             strcmp(member->settings.pool, bep->settings.pool) == 0)) {
+            cl->members[i++] = member;
+        }
+    }
+
+    TAILQ_FOREACH(entry, &bep->uris, next) {
+        cl->nuris++;
+    }
+    cl->uris = (struct agg_uri *) calloc(cl->nuris + 1, sizeof *cl->uris);
+    alloc_fail_check(cl->uris);
+    i = 0;
+    TAILQ_FOREACH(entry, &bep->uris, next) {
+        cl->uris[i].entry = entry;
+        cl->uris[i].generation =
+            (uint64_t *) calloc(cl->nmembers + 1, sizeof(uint64_t));
+        alloc_fail_check(cl->uris[i].generation);
+        cl->uris[i].stamp =
+            (uint64_t *) calloc(cl->nmembers + 1, sizeof(uint64_t));
+        alloc_fail_check(cl->uris[i].stamp);
+        i++;
+    }
+    return cl;
+}
+
+// one aggregation cycle
+static void
+clusterPoll(struct cluster *cl)
+{
+    backend_t            *bep = cl->bep;
+    backend_t            *member;
+    struct uri_entry     *entry;
+    struct agg_uri       *au;
+    int                  polling = 0;
+    int                  m;
+    int                  u;
+
+    for (m = 0; m < cl->nmembers; m++) {
+        member = cl->members[m];
+        rdlock(member);
+        if (member->state == POLLING) {
+            polling++;
+            for (u = 0; u < cl->nuris; u++) {
+                au = &cl->uris[u];
+                TAILQ_FOREACH(entry, &member->uris, next) {
+                    if (strcmp(entry->uri, au->entry->uri) == 0) {
+                        foldMember(cl, au, m, entry);
+                        break;
+                    }
+                }
+            }
+        } else {
+            for (u = 0; u < cl->nuris; u++) {
+                dropMember(&cl->uris[u], m);
+            }
+        }
+        unlock(member);
+    }
+
+    for (u = 0; u < cl->nuris; u++) {
+        buildStats(cl, &cl->uris[u], polling, &bep->builder);
+        stageStats(cl->uris[u].entry, &bep->builder);
+    }
+
+    wrlock(bep);
+    bep->state = (polling > 0) ? POLLING : FAULT;
+    bep->last_error = (polling > 0) ? 0 : ENOTCONN;
+    unlock(bep);
+    publishCycle(bep);
+}
+
+void *
+cluster_run(void *arg)
+{
+    struct cluster *cl = (struct cluster *) arg;
+    backend_t      *bep = cl->bep;
+    uint64_t       due = wheel_now() + bep->phase_ms;
+
+    for (;;) {
+        latency_record(bep->latency, LATENCY_DRIFT,
+                       wheel_sleep(&bep->timer, due));
+        clusterPoll(cl);
+
+        due += bep->settings.pollfreq_ms;
+        if (due <= wheel_now()) {
+            due = wheel_now() + bep->settings.pollfreq_ms;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,975 @@
+// ========================================================================
+//
+//  Project   : statsproxy 
+//
+//  Version   : 1.0
+//
+//  Copyright :
+//
+//      Software License Agreement (BSD License)
+//
+//      Copyright (c) 2009, Gear Six, Inc.
+//      All rights reserved.
+//
+//      Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are
+//      met:
+//
+//      * Redistributions of source code must retain the above copyright
+//        notice, this list of conditions and the following disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following disclaimer
+//        in the documentation and/or other materials provided with the
+//        distribution.
+//
+//      * Neither the name of Gear Six, Inc. nor the names of its
+//        contributors may be used to endorse or promote products derived from
+//        this software without specific prior written permission.The Gear Six logo, 
+//        which is provided in the source code and appears on the user interface 
+//        to identify Gear Six, Inc. as the originator of the software program, is 
+//        a trademark of Gear Six, Inc. and can be used only in unaltered form and 
+//        only for purposes of such identification.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// ========================================================================
+//
+#include <stdio.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "queue.h"
+#include "statsproxy.h"
+#include "proxylog.h"
+#include "history.h"
+#include "state.h"
+
+// Points are compressed as in Facebook's Gorilla: the time as the delta of
+// its delta from the point before (a single 0 bit for a steady poll
+// interval), each value as its xor with the value before (a single 0 bit
+// when unchanged, otherwise only the bits that differ).  A block holds
+// points until the worst case point would no longer fit.
+#define HISTORY_BLOCK_BITS  (HISTORY_BLOCK_BYTES * 8)
+#define TIME_BITS           (4 + 32)
+#define VALUE_BITS          (2 + 6 + 6 + 64)
+#define NO_WINDOW           0xff
+#define DOD_BIAS            0x7fffffff
+
+// a rollup point - one closed minute or hour of a stat, with the time of
+// its latest point
+enum rollup_field {
+    ROLLUP_COUNT, ROLLUP_SUM, ROLLUP_MIN, ROLLUP_MAX, ROLLUP_LAST,
+    ROLLUP_LAST_T, ROLLUP_FIELDS
+};
+
+static const int tierWidth[NUM_TIERS] = { 0, 60, 3600 };
+static const int tierFields[NUM_TIERS] = { 1, ROLLUP_FIELDS, ROLLUP_FIELDS };
+
+// coding state of one value of a block's points
+struct history_field {
+    uint64_t                   first;          // value of the first point
+    uint64_t                   last;           // value of the last point
+    uint8_t                    leading;        // last xor window
+    uint8_t                    trailing;
+};
+
+struct history_block {
+    struct history_block       *next;          // next (newer) block
+    time_t                     first;          // time of the first point
+    time_t                     last;           // time of the last point
+    int64_t                    delta;          // last time delta
+    uint32_t                   count;          // points in the block
+    uint16_t                   nbits;          // bits used in data
+    uint8_t                    nfields;        // values per point
+    uint8_t                    data[HISTORY_BLOCK_BYTES];
+    struct history_field       fields[1];      // nfields of them
+};
+
+// one tier of a stat's history, oldest block first, and the minute or
+// hour being rolled up
+struct history_series_tier {
+    struct history_block       *head;          // oldest block
+    struct history_block       *tail;          // newest block
+    time_t                     open;           // start of open bucket (or 0)
+    uint64_t                   bucket[ROLLUP_FIELDS]; // the open bucket
+};
+
+struct history_series {
+    char                       *name;          // "<uri>:<name>"
+    struct history_series_tier tiers[NUM_TIERS];
+};
+
+struct history {
+    pthread_mutex_t            lock;
+    int                        retention;      // seconds of raw points
+    int                        nseries;        // number of series
+    int                        seriesSize;     // size of series
+    int                        sweep;          // next series to expire
+    struct history_series      **series;       // series sorted by name
+    pthread_mutex_t            saveLock;       // guards the saved copy
+    char                       *saved;         // series as last saved
+    size_t                     savedLen;
+    uint64_t                   savedCount;     // series in saved
+};
+
+struct bit_reader {
+    const uint8_t              *data;
+    int                        pos;
+};
+
+// called for each decoded point
+typedef void (*point_fn)(void *arg, time_t t, const uint64_t *vals);
+
+struct history *
+history_new(int retention)
+{
+    struct history *h;
+
+    h = (struct history *) calloc(1, sizeof *h);
+    alloc_fail_check(h);
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_mutex_init(&h->saveLock, NULL);
+    h->retention = retention;
+    return h;
+}
+
+// the minutes go with the raw points, the hours are kept longer
+static time_t
+tierRetention(struct history *h, int tier)
+{
+    if (tier == TIER_HOUR && h->retention < HISTORY_HOURLY_DAYS * 86400) {
+        return HISTORY_HOURLY_DAYS * 86400;
+    }
+    return h->retention;
+}
+
+// plain counters and gauges only - versions, times and floats are skipped
+static bool_t
+numericValue(struct stats_entry *entry, uint64_t *val)
+{
+    size_t len;
+
+    if (entry->type == UINT64) {
+        *val = entry->v.value;
+        return TRUE;
+    }
+    len = strspn(entry->v.valueStr, "0123456789");
+    if (len == 0 || len >= 20 || entry->v.valueStr[len] != '\0') {
+        return FALSE;
+    }
+    *val = strtoull(entry->v.valueStr, NULL, 10);
+    return TRUE;
+}
+
+// binary search for a series; *pos is where it would go when missing
+static struct history_series *
+findSeries(struct history *h, const char *name, int *pos)
+{
+    int lo = 0;
+    int hi = h->nseries;
+    int mid;
+    int cmp;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        cmp = strcmp(h->series[mid]->name, name);
+        if (cmp == 0) {
+            *pos = mid;
+            return h->series[mid];
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *pos = lo;
+    return NULL;
+}
+
+static struct history_series *
+addSeries(struct history *h, const char *name, int pos)
+{
+    struct history_series *s;
+
+    if (h->nseries == h->seriesSize) {
+        h->seriesSize = h->seriesSize ? h->seriesSize * 2 : 64;
+        h->series = (struct history_series **)
+            realloc(h->series, h->seriesSize * sizeof *h->series);
+        alloc_fail_check(h->series);
+    }
+    s = (struct history_series *) calloc(1, sizeof *s);
+    alloc_fail_check(s);
+    s->name = strdup(name);
+    alloc_fail_check(s->name);
+    memmove(&h->series[pos + 1], &h->series[pos],
+            (h->nseries - pos) * sizeof *h->series);
+    h->series[pos] = s;
+    h->nseries++;
+    return s;
+}
+
+static void
+removeSeries(struct history *h, int pos)
+{
+    free(h->series[pos]->name);
+    free(h->series[pos]);
+    memmove(&h->series[pos], &h->series[pos + 1],
+            (h->nseries - pos - 1) * sizeof *h->series);
+    h->nseries--;
+}
+
+// append the low n bits of bits, most significant first
+static void
+putBits(struct history_block *blk, uint64_t bits, int n)
+{
+    int room;
+    int take;
+
+    while (n > 0) {
+        room = 8 - (blk->nbits & 7);
+        take = n < room ? n : room;
+        blk->data[blk->nbits >> 3] |=
+            ((bits >> (n - take)) & ((1u << take) - 1)) << (room - take);
+        blk->nbits += take;
+        n -= take;
+    }
+}
+
+static uint64_t
+getBits(struct bit_reader *r, int n)
+{
+    uint64_t v = 0;
+    int      room;
+    int      take;
+
+    while (n > 0) {
+        room = 8 - (r->pos & 7);
+        take = n < room ? n : room;
+        v = (v << take) |
+            ((r->data[r->pos >> 3] >> (room - take)) & ((1u << take) - 1));
+        r->pos += take;
+        n -= take;
+    }
+    return v;
+}
+
+// delta of delta in one of five buckets: 0, '10' + 7 bits, '110' + 9 bits,
+// '1110' + 12 bits or '1111' + 32 bits
+static void
+putTime(struct history_block *blk, int64_t dod)
+{
+    if (dod == 0) {
+        putBits(blk, 0, 1);
+    } else if (dod >= -63 && dod <= 64) {
+        putBits(blk, 0x2, 2);
+        putBits(blk, dod + 63, 7);
+    } else if (dod >= -255 && dod <= 256) {
+        putBits(blk, 0x6, 3);
+        putBits(blk, dod + 255, 9);
+    } else if (dod >= -2047 && dod <= 2048) {
+        putBits(blk, 0xe, 4);
+        putBits(blk, dod + 2047, 12);
+    } else {
+        putBits(blk, 0xf, 4);
+        putBits(blk, dod + DOD_BIAS, 32);
+    }
+}
+
+static int64_t
+getTime(struct bit_reader *r)
+{
+    if (getBits(r, 1) == 0) {
+        return 0;
+    } else if (getBits(r, 1) == 0) {
+        return (int64_t) getBits(r, 7) - 63;
+    } else if (getBits(r, 1) == 0) {
+        return (int64_t) getBits(r, 9) - 255;
+    } else if (getBits(r, 1) == 0) {
+        return (int64_t) getBits(r, 12) - 2047;
+    }
+    return (int64_t) getBits(r, 32) - DOD_BIAS;
+}
+
+// xor with the last value: 0 when unchanged, '10' + the bits inside the
+// last window when they fit, else '11' + 6 bits of leading zeros + 6 bits
+// of length + the bits that differ
+static void
+putValue(struct history_block *blk, struct history_field *f, uint64_t value)
+{
+    uint64_t x = value ^ f->last;
+    int      leading;
+    int      trailing;
+
+    f->last = value;
+    if (x == 0) {
+        putBits(blk, 0, 1);
+        return;
+    }
+    leading = __builtin_clzll(x);
+    trailing = __builtin_ctzll(x);
+    if (f->leading != NO_WINDOW && leading >= f->leading &&
+        trailing >= f->trailing) {
+        putBits(blk, 0x2, 2);
+        putBits(blk, x >> f->trailing, 64 - f->leading - f->trailing);
+        return;
+    }
+    putBits(blk, 0x3, 2);
+    putBits(blk, leading, 6);
+    putBits(blk, 64 - leading - trailing - 1, 6);
+    putBits(blk, x >> trailing, 64 - leading - trailing);
+    f->leading = leading;
+    f->trailing = trailing;
+}
+
+static uint64_t
+getValue(struct bit_reader *r, uint64_t last, int *leading, int *trailing)
+{
+    int len;
+
+    if (getBits(r, 1) == 0) {
+        return last;
+    }
+    if (getBits(r, 1) != 0) {
+        *leading = getBits(r, 6);
+        len = getBits(r, 6) + 1;
+        *trailing = 64 - *leading - len;
+    }
+    len = 64 - *leading - *trailing;
+    return last ^ (getBits(r, len) << *trailing);
+}
+
+// append a point to a tier's blocks, starting a block when it won't fit
+static void
+appendPoint(struct history_series_tier *st, int nfields, time_t t,
+            const uint64_t *vals)
+{
+    struct history_block *blk = st->tail;
+    int64_t              delta = 0;
+    int64_t              dod = 0;
+    int                  i;
+
+    if (blk != NULL) {
+        delta = t - blk->last;
+        dod = delta - blk->delta;
+        if (blk->nbits + TIME_BITS + nfields * VALUE_BITS >
+            HISTORY_BLOCK_BITS ||
+            dod < -DOD_BIAS || dod > (int64_t) DOD_BIAS + 1) {
+            blk = NULL;
+        }
+    }
+
+    if (blk == NULL) {
+        // the first point of a block is kept whole in its header
+        blk = (struct history_block *)
+            calloc(1, sizeof *blk + (nfields - 1) * sizeof blk->fields[0]);
+        alloc_fail_check(blk);
+        blk->first = blk->last = t;
+        blk->count = 1;
+        blk->nfields = nfields;
+        for (i = 0; i < nfields; i++) {
+            blk->fields[i].first = blk->fields[i].last = vals[i];
+            blk->fields[i].leading = NO_WINDOW;
+        }
+        if (st->tail != NULL) {
+            st->tail->next = blk;
+        } else {
+            st->head = blk;
+        }
+        st->tail = blk;
+        return;
+    }
+    putTime(blk, dod);
+    for (i = 0; i < nfields; i++) {
+        putValue(blk, &blk->fields[i], vals[i]);
+    }
+    blk->delta = delta;
+    blk->last = t;
+    blk->count++;
+}
+
+// move a finished minute or hour into the tier's blocks
+static void
+closeBucket(struct history_series_tier *st)
+{
+    appendPoint(st, ROLLUP_FIELDS, st->open, st->bucket);
+    st->open = 0;
+}
+
+// drop the blocks that hold nothing newer than the tier's retention, and
+// close a minute or hour that has ended without a point after it
+static void
+expireSeries(struct history *h, struct history_series *s, time_t now)
+{
+    struct history_series_tier *st;
+    struct history_block       *blk;
+    int                        tier;
+
+    for (tier = 0; tier < NUM_TIERS; tier++) {
+        st = &s->tiers[tier];
+        if (st->open != 0 && st->open + tierWidth[tier] <= now) {
+            closeBucket(st);
+        }
+        while ((blk = st->head) != NULL &&
+               blk->last < now - tierRetention(h, tier)) {
+            st->head = blk->next;
+            free(blk);
+        }
+        if (st->head == NULL) {
+            st->tail = NULL;
+        }
+    }
+}
+
+static bool_t
+emptySeries(struct history_series *s)
+{
+    int tier;
+
+    for (tier = 0; tier < NUM_TIERS; tier++) {
+        if (s->tiers[tier].head != NULL || s->tiers[tier].open != 0) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// add a point to the raw tier and roll it up into the open minute and hour
+static void
+addPoint(struct history *h, struct history_series *s, time_t t,
+         uint64_t value)
+{
+    struct history_series_tier *st = &s->tiers[TIER_RAW];
+    uint64_t                   *b;
+    time_t                     start;
+    int                        tier;
+
+    if (st->tail != NULL && t <= st->tail->last) {
+        return; // time has to move on
+    }
+    appendPoint(st, 1, t, &value);
+
+    for (tier = TIER_MINUTE; tier < NUM_TIERS; tier++) {
+        st = &s->tiers[tier];
+        b = st->bucket;
+        start = t - t % tierWidth[tier];
+        if (st->open != 0 && st->open != start) {
+            closeBucket(st);
+        }
+        if (st->open == 0) {
+            st->open = start;
+            b[ROLLUP_COUNT] = 0;
+            b[ROLLUP_SUM] = 0;
+            b[ROLLUP_MIN] = value;
+            b[ROLLUP_MAX] = value;
+        }
+        b[ROLLUP_COUNT]++;
+        b[ROLLUP_SUM] += value;
+        b[ROLLUP_MIN] = value < b[ROLLUP_MIN] ? value : b[ROLLUP_MIN];
+        b[ROLLUP_MAX] = value > b[ROLLUP_MAX] ? value : b[ROLLUP_MAX];
+        b[ROLLUP_LAST] = value;
+        b[ROLLUP_LAST_T] = t;
+    }
+    expireSeries(h, s, t);
+}
+
+void
+history_update(backend_t *bep, uint64_t now)
+{
+    struct history        *h = bep->history;
+    struct uri_entry      *uri_entry;
+    struct stats_entry    *entry;
+    struct history_series *s;
+    char                  name[MAXREQSZ];
+    time_t                t = now / NUM_MSECS_PER_SEC;
+    uint64_t              val;
+    int                   pos;
+    int                   i;
+
+    if (h == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&h->lock);
+    TAILQ_FOREACH(uri_entry, &bep->uris, next) {
+        if (uri_entry->published_ms != now) {
+            continue; // not polled this cycle
+        }
+        for (i = 0; i < uri_entry->stats->count; i++) {
+            entry = &uri_entry->stats->entries[i];
+            if (!numericValue(entry, &val)) {
+                continue;
+            }
+            snprintf(name, sizeof name, "%s:%s", uri_entry->uri, entry->name);
+            s = findSeries(h, name, &pos);
+            if (s == NULL) {
+                s = addSeries(h, name, pos);
+            }
+            addPoint(h, s, t, val);
+        }
+    }
+
+    // expire one series per update, so stats that went away go too
+    if (h->nseries > 0) {
+        pos = h->sweep++ % h->nseries;
+        expireSeries(h, h->series[pos], t);
+        if (emptySeries(h->series[pos])) {
+            removeSeries(h, pos);
+        }
+    }
+    pthread_mutex_unlock(&h->lock);
+}
+
+// decode the points of a block between from and to
+static void
+decodeBlock(const struct history_block *blk, time_t from, time_t to,
+            point_fn fn, void *arg)
+{
+    struct bit_reader r;
+    time_t            t = blk->first;
+    int64_t           delta = 0;
+    uint64_t          vals[ROLLUP_FIELDS];
+    int               leading[ROLLUP_FIELDS];
+    int               trailing[ROLLUP_FIELDS];
+    uint32_t          i;
+    int               f;
+
+    for (f = 0; f < blk->nfields; f++) {
+        vals[f] = blk->fields[f].first;
+    }
+    r.data = blk->data;
+    r.pos = 0;
+    for (i = 0; i < blk->count && t <= to; i++) {
+        if (i > 0) {
+            delta += getTime(&r);
+            t += delta;
+            for (f = 0; f < blk->nfields; f++) {
+                vals[f] = getValue(&r, vals[f], &leading[f], &trailing[f]);
+            }
+        }
+        if (t >= from && t <= to) {
+            (*fn)(arg, t, vals);
+        }
+    }
+}
+
+// decode a tier of a series between from and to, the open bucket last
+static void
+decodeTier(struct history_series *s, int tier, time_t from, time_t to,
+           point_fn fn, void *arg)
+{
+    struct history_series_tier *st = &s->tiers[tier];
+    struct history_block       *blk;
+
+    for (blk = st->head; blk != NULL; blk = blk->next) {
+        if (blk->last >= from && blk->first <= to) {
+            decodeBlock(blk, from, to, fn, arg);
+        }
+    }
+    if (st->open != 0 && st->open >= from && st->open <= to) {
+        (*fn)(arg, st->open, st->bucket);
+    }
+}
+
+struct point_list {
+    struct history_point       *points;
+    int                        count;
+    int                        size;
+};
+
+static void
+listPoint(void *arg, time_t t, const uint64_t *vals)
+{
+    struct point_list *pl = (struct point_list *) arg;
+
+    if (pl->count == pl->size) {
+        pl->size = pl->size ? pl->size * 2 : 256;
+        pl->points = (struct history_point *)
+            realloc(pl->points, pl->size * sizeof *pl->points);
+        alloc_fail_check(pl->points);
+    }
+    pl->points[pl->count].t = t;
+    pl->points[pl->count].value = vals[0];
+    pl->count++;
+}
+
+int
+history_query(struct history *h, const char *name, time_t from, time_t to,
+              struct history_point **points)
+{
+    struct history_series *s;
+    struct point_list     pl;
+    int                   pos;
+
+    memset(&pl, 0, sizeof pl);
+    if (h != NULL) {
+        pthread_mutex_lock(&h->lock);
+        s = findSeries(h, name, &pos);
+        if (s != NULL) {
+            decodeTier(s, TIER_RAW, from, to, listPoint, &pl);
+        }
+        pthread_mutex_unlock(&h->lock);
+    }
+    *points = pl.points;
+    return pl.count;
+}
+
+// output buckets of a range query; the one before from only serves as the
+// base of the first rate
+struct range_fold {
+    time_t                     base;           // start of the base bucket
+    int                        step;           // bucket width
+    int                        n;              // buckets after the base
+    int                        tier;           // tier being read
+    struct history_bucket      *buckets;       // base + n buckets
+};
+
+static void
+foldPoint(void *arg, time_t t, const uint64_t *vals)
+{
+    struct range_fold     *rf = (struct range_fold *) arg;
+    struct history_bucket *b;
+    int                   i = (t - rf->base) / rf->step;
+    uint64_t              count = 1;
+    uint64_t              sum = vals[0];
+    uint64_t              min = vals[0];
+    uint64_t              max = vals[0];
+    uint64_t              last = vals[0];
+
+    if (i < 0 || i > rf->n) {
+        return;
+    }
+    if (rf->tier != TIER_RAW) {
+        count = vals[ROLLUP_COUNT];
+        sum = vals[ROLLUP_SUM];
+        min = vals[ROLLUP_MIN];
+        max = vals[ROLLUP_MAX];
+        last = vals[ROLLUP_LAST];
+        t = vals[ROLLUP_LAST_T]; // rates are measured from the latest point
+    }
+    b = &rf->buckets[i];
+    if (b->count == 0) {
+        b->firstT = t;
+        b->first = last;
+    }
+    if (b->count == 0 || min < b->min) {
+        b->min = min;
+    }
+    if (b->count == 0 || max > b->max) {
+        b->max = max;
+    }
+    b->count += count;
+    b->sum += sum;
+    b->lastT = t;
+    b->last = last;
+}
+
+int
+history_range(struct history *h, const char *name, time_t from, time_t to,
+              int *stepp, struct history_bucket **buckets,
+              enum history_tier *tier)
+{
+    struct history_series *s;
+    struct history_bucket *b;
+    struct range_fold     rf;
+    int                   step = *stepp;
+    int                   prev;
+    int                   pos;
+    int                   i;
+    time_t                baseT;
+    uint64_t              base;
+
+    *buckets = NULL;
+    if (step <= 0 || step > HISTORY_MAX_STEP || to < from) {
+        return -1;
+    }
+
+    // the coarsest tier with points no wider than a step, or the hours
+    // when the range reaches past the points and minutes, the step rounded
+    // up to a whole number of them
+    for (rf.tier = NUM_TIERS - 1; tierWidth[rf.tier] > step; rf.tier--) {
+    }
+    if (h != NULL && from < time(NULL) - tierRetention(h, rf.tier)) {
+        rf.tier = TIER_HOUR;
+    }
+    if (tierWidth[rf.tier] > 0) {
+        step += (tierWidth[rf.tier] - step % tierWidth[rf.tier]) %
+                tierWidth[rf.tier];
+    }
+    *tier = (enum history_tier) rf.tier;
+    *stepp = step;
+
+    from -= from % step;
+    if ((to - from) / step >= HISTORY_MAX_BUCKETS) {
+        return -1;
+    }
+    rf.step = step;
+    rf.base = from - step;
+    rf.n = (to - from) / step + 1;
+    rf.buckets = (struct history_bucket *)
+        calloc(rf.n + 1, sizeof *rf.buckets);
+    alloc_fail_check(rf.buckets);
+    for (i = 0; i <= rf.n; i++) {
+        rf.buckets[i].start = rf.base + (time_t) i * step;
+    }
+
+    if (h != NULL) {
+        pthread_mutex_lock(&h->lock);
+        s = findSeries(h, name, &pos);
+        if (s != NULL) {
+            decodeTier(s, rf.tier, rf.base, to, foldPoint, &rf);
+        }
+        pthread_mutex_unlock(&h->lock);
+    }
+
+    // rates over the times of the bucket's first and latest points, or
+    // from the previous bucket's latest point when it holds just the one;
+    // none without a base or across a counter reset
+    for (i = 1, prev = rf.buckets[0].count ? 0 : -1; i <= rf.n; i++) {
+        b = &rf.buckets[i];
+        if (b->count == 0) {
+            continue;
+        }
+        baseT = b->firstT;
+        base = b->first;
+        if (baseT == b->lastT && prev >= 0) {
+            baseT = rf.buckets[prev].lastT;
+            base = rf.buckets[prev].last;
+        }
+        if (baseT < b->lastT && b->last >= base) {
+            b->rate = (double) (b->last - base) / (b->lastT - baseT);
+            b->hasRate = TRUE;
+        }
+        prev = i;
+    }
+
+    memmove(rf.buckets, rf.buckets + 1, rf.n * sizeof *rf.buckets);
+    *buckets = rf.buckets;
+    return rf.n;
+}
+
+void
+history_usage(struct history *h, struct history_usage *usage)
+{
+    struct history_block *blk;
+    int                  i;
+    int                  tier;
+
+    memset(usage, 0, sizeof *usage);
+    if (h == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&h->lock);
+    usage->series = h->nseries;
+    for (i = 0; i < h->nseries; i++) {
+        usage->bytes += sizeof *h->series[i];
+        for (tier = 0; tier < NUM_TIERS; tier++) {
+            for (blk = h->series[i]->tiers[tier].head; blk != NULL;
+                 blk = blk->next) {
+                usage->blocks++;
+                usage->bytes += sizeof *blk +
+                    (blk->nfields - 1) * sizeof blk->fields[0];
+                if (tier == TIER_RAW) {
+                    usage->points += blk->count;
+                    usage->bits += blk->nbits;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&h->lock);
+}
+
+// one series, as the state file holds it
+static void
+saveSeries(struct history_series *s, FILE *fp)
+{
+    struct history_series_tier *st;
+    struct history_block       *blk;
+    uint64_t                   count;
+    int                        tier;
+    int                        f;
+
+    state_put_str(fp, s->name);
+    for (tier = 0; tier < NUM_TIERS; tier++) {
+        st = &s->tiers[tier];
+        state_put_u64(fp, st->open);
+        for (f = 0; f < ROLLUP_FIELDS; f++) {
+            state_put_u64(fp, st->bucket[f]);
+        }
+        count = 0;
+        for (blk = st->head; blk != NULL; blk = blk->next) {
+            count++;
+        }
+        state_put_u64(fp, count);
+        for (blk = st->head; blk != NULL; blk = blk->next) {
+            state_put_u64(fp, blk->first);
+            state_put_u64(fp, blk->last);
+            state_put_u64(fp, blk->delta);
+            state_put_u64(fp, blk->count);
+            state_put_u64(fp, blk->nbits);
+            state_put_u64(fp, blk->nfields);
+            state_put_bytes(fp, blk->data, (blk->nbits + 7) / 8);
+            for (f = 0; f < blk->nfields; f++) {
+                state_put_u64(fp, blk->fields[f].first);
+                state_put_u64(fp, blk->fields[f].last);
+                state_put_u64(fp, blk->fields[f].leading);
+                state_put_u64(fp, blk->fields[f].trailing);
+            }
+        }
+    }
+}
+
+// serialize the series one at a time, so a poller waits on the lock for
+// one series at most; series added or removed meanwhile are found by name
+void
+history_checkpoint(struct history *h)
+{
+    struct history_series *s;
+    FILE                  *fp;
+    char                  *data = NULL;
+    char                  *last = NULL;
+    size_t                len = 0;
+    uint64_t              count = 0;
+    int                   pos;
+
+    if (h == NULL) {
+        return;
+    }
+    fp = open_memstream(&data, &len);
+    alloc_fail_check(fp);
+    do {
+        pthread_mutex_lock(&h->lock);
+        pos = 0;
+        if (last != NULL && findSeries(h, last, &pos) != NULL) {
+            pos++;
+        }
+        free(last);
+        last = NULL;
+        if (pos < h->nseries) {
+            s = h->series[pos];
+            saveSeries(s, fp);
+            last = strdup(s->name);
+            alloc_fail_check(last);
+            count++;
+        }
+        pthread_mutex_unlock(&h->lock);
+    } while (last != NULL);
+    fclose(fp);
+
+    pthread_mutex_lock(&h->saveLock);
+    free(h->saved);
+    h->saved = data;
+    h->savedLen = len;
+    h->savedCount = count;
+    pthread_mutex_unlock(&h->saveLock);
+}
+
+void
+history_save(struct history *h, FILE *fp)
+{
+    if (h == NULL) {
+        state_put_u64(fp, 0);
+        return;
+    }
+    pthread_mutex_lock(&h->saveLock);
+    if (h->saved == NULL) {
+        pthread_mutex_unlock(&h->saveLock);
+        history_checkpoint(h);
+        pthread_mutex_lock(&h->saveLock);
+    }
+    state_put_u64(fp, h->savedCount);
+    state_put_bytes(fp, h->saved, h->savedLen);
+    pthread_mutex_unlock(&h->saveLock);
+}
+
+void
+history_load(struct history *h, struct state_reader *r)
+{
+    struct history_series      *s;
+    struct history_series_tier st;
+    struct history_block       *blk;
+    char                       *name;
+    uint64_t                   nseries;
+    uint64_t                   nblocks;
+    uint64_t                   nbits;
+    uint64_t                   nfields;
+    uint64_t                   i;
+    uint64_t                   j;
+    int                        tier;
+    int                        f;
+    int                        pos;
+
+    nseries = state_get_u64(r);
+    for (i = 0; i < nseries && !r->err; i++) {
+        name = state_get_str(r);
+        s = NULL;
+        if (h != NULL && name != NULL && findSeries(h, name, &pos) == NULL) {
+            s = addSeries(h, name, pos);
+        }
+        free(name);
+        for (tier = 0; tier < NUM_TIERS && !r->err; tier++) {
+            memset(&st, 0, sizeof st);
+            st.open = state_get_u64(r);
+            for (f = 0; f < ROLLUP_FIELDS; f++) {
+                st.bucket[f] = state_get_u64(r);
+            }
+            nblocks = state_get_u64(r);
+            for (j = 0; j < nblocks && !r->err; j++) {
+                blk = (struct history_block *)
+                    calloc(1, sizeof *blk +
+                           (ROLLUP_FIELDS - 1) * sizeof blk->fields[0]);
+                alloc_fail_check(blk);
+                blk->first = state_get_u64(r);
+                blk->last = state_get_u64(r);
+                blk->delta = state_get_u64(r);
+                blk->count = state_get_u64(r);
+                nbits = state_get_u64(r);
+                nfields = state_get_u64(r);
+                if (nbits > HISTORY_BLOCK_BITS || nfields < 1 ||
+                    nfields > ROLLUP_FIELDS) {
+                    r->err = TRUE;
+                    free(blk);
+                    break;
+                }
+                blk->nbits = nbits;
+                blk->nfields = nfields;
+                state_get_bytes(r, blk->data, (nbits + 7) / 8);
+                for (f = 0; f < blk->nfields; f++) {
+                    blk->fields[f].first = state_get_u64(r);
+                    blk->fields[f].last = state_get_u64(r);
+                    blk->fields[f].leading = state_get_u64(r);
+                    blk->fields[f].trailing = state_get_u64(r);
+                }
+                if (st.tail != NULL) {
+                    st.tail->next = blk;
+                } else {
+                    st.head = blk;
+                }
+                st.tail = blk;
+            }
+            if (s != NULL) {
+                s->tiers[tier] = st;
+            } else {
+                while ((blk = st.head) != NULL) {
+                    st.head = blk->next;
+                    free(blk);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,141 @@
+// ========================================================================
+//
+//  Project   : statsproxy 
+//
+//  Version   : 1.0
+//
+//  Copyright :
+//
+//      Software License Agreement (BSD License)
+//
+//      Copyright (c) 2009, Gear Six, Inc.
+//      All rights reserved.
+//
+//      Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are
+//      met:
+//
+//      * Redistributions of source code must retain the above copyright
+//        notice, this list of conditions and the following disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following disclaimer
+//        in the documentation and/or other materials provided with the
+//        distribution.
+//
+//      * Neither the name of Gear Six, Inc. nor the names of its
+//        contributors may be used to endorse or promote products derived from
+//        this software without specific prior written permission.The Gear Six logo, 
+//        which is provided in the source code and appears on the user interface 
+//        to identify Gear Six, Inc. as the originator of the software program, is 
+//        a trademark of Gear Six, Inc. and can be used only in unaltered form and 
+//        only for purposes of such identification.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// ========================================================================
+//
+
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// hours of history kept for every stat by default (0 keeps none) and at
+// most, the size of the compressed blocks and the default length of a
+// range query
+#define DEFAULT_HISTORY_HOURS   24
+#define HISTORY_MAX_HOURS       (366 * 24)
+#define HISTORY_BLOCK_BYTES     256
+#define DEFAULT_HISTORY_SECONDS 3600
+
+// the hourly rollups are kept at least this long, and a range query
+// returns at most this many buckets, each at most this many seconds wide
+#define HISTORY_HOURLY_DAYS     31
+#define HISTORY_MAX_BUCKETS     10000
+#define HISTORY_MAX_STEP        (HISTORY_HOURLY_DAYS * 86400)
+
+// every stat's history is kept raw and rolled up per minute and per hour
+enum history_tier { TIER_RAW, TIER_MINUTE, TIER_HOUR, NUM_TIERS };
+
+// one point of a stat's history
+struct history_point {
+    time_t                     t;              // publish time
+    uint64_t                   value;          // value
+};
+
+// one bucket of a range query
+struct history_bucket {
+    time_t                     start;          // start of the bucket
+    uint64_t                   count;          // points in the bucket
+    uint64_t                   sum;            // their sum
+    uint64_t                   min;            // smallest
+    uint64_t                   max;            // largest
+    time_t                     firstT;         // time of the first point
+    uint64_t                   first;          // its value
+    time_t                     lastT;          // time of the latest point
+    uint64_t                   last;           // latest
+    int                        hasRate;        // rate is known
+    double                     rate;           // per second change of last
+};
+
+// what a backend's history holds
+struct history_usage {
+    uint64_t                   series;         // stats with a history
+    uint64_t                   blocks;         // compressed blocks
+    uint64_t                   points;         // points in the blocks
+    uint64_t                   bits;           // bits used by the points
+    uint64_t                   bytes;          // memory held by the blocks
+};
+
+// a backend's history, keeping raw points for retention seconds
+struct history *history_new(int retention);
+
+// append a backend's freshly published numeric stats, named
+// "<uri>:<name>" (called by its poller with the backend locked); now is
+// the publish time in ms
+void history_update(backend_t *bep, uint64_t now);
+
+// decode the raw points of one stat between from and to (inclusive, in
+// seconds) into *points, oldest first; returns how many were found.
+// The caller frees *points.
+int history_query(struct history *h, const char *name, time_t from,
+                  time_t to, struct history_point **points);
+
+// aggregate one stat between from and to into buckets of *step seconds,
+// read from the coarsest tier that fits in a step (*tier); the step is
+// rounded up to a whole number of the tier's points.  Returns the
+// number of buckets in *buckets (empty ones have a zero count), which the
+// caller frees, or -1 when the step is out of bounds or the range needs
+// too many buckets.  A bucket's rate is left out (hasRate unset) when it
+// has no earlier point to measure from.
+int history_range(struct history *h, const char *name, time_t from,
+                  time_t to, int *step, struct history_bucket **buckets,
+                  enum history_tier *tier);
+
+void history_usage(struct history *h, struct history_usage *usage);
+
+// serialize a history for the state file; history_save writes the latest
+// such copy (taking one first if there's none) and history_load reads one
+// back (a NULL history reads past it)
+void history_checkpoint(struct history *h);
+void history_save(struct history *h, FILE *fp);
+struct state_reader;
+void history_load(struct history *h, struct state_reader *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _HISTORY_H */
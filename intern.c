@@ -0,0 +1,171 @@
+// ========================================================================
+//
+//  Project   : statsproxy 
+//
+//  Version   : 1.0
+//
+//  Copyright :
+//
+//      Software License Agreement (BSD License)
+//
+//      Copyright (c) 2009, Gear Six, Inc.
+//      All rights reserved.
+//
+//      Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are
+//      met:
+//
+//      * Redistributions of source code must retain the above copyright
+//        notice, this list of conditions and the following disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following disclaimer
+//        in the documentation and/or other materials provided with the
+//        distribution.
+//
+//      * Neither the name of Gear Six, Inc. nor the names of its
+//        contributors may be used to endorse or promote products derived from
+//        this software without specific prior written permission.The Gear Six logo, 
+//        which is provided in the source code and appears on the user interface 
+//        to identify Gear Six, Inc. as the originator of the software program, is 
+//        a trademark of Gear Six, Inc. and can be used only in unaltered form and 
+//        only for purposes of such identification.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// ========================================================================
+//
+#include <stdio.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+
+#include "queue.h"
+#include "statsproxy.h"
+#include "proxylog.h"
+#include "intern.h"
+
+// names are copied into chunks that never move
+#define INTERN_CHUNK 65536
+
+// one name in the hash table
+struct intern_slot {
+    const char                 *name;          // stored name (NULL if free)
+    uint32_t                   id;             // its number
+    uint32_t                   hash;           // low bits of its hash
+};
+
+// open addressing table, kept under half full. Lookups share the read
+// lock; a name seen for the first time takes the write lock.
+static pthread_rwlock_t   internLock = PTHREAD_RWLOCK_INITIALIZER;
+static struct intern_slot *table;
+static uint32_t           tableSize;           // power of two
+static uint32_t           count;               // names interned
+static char               *chunk;              // current name chunk
+static size_t             chunkUsed;
+
+static struct intern_slot *
+lookup(const char *name, uint32_t hash)
+{
+    uint32_t i;
+
+    if (tableSize == 0) {
+        return NULL;
+    }
+    for (i = hash & (tableSize - 1); table[i].name != NULL;
+         i = (i + 1) & (tableSize - 1)) {
+        if (table[i].hash == hash && strcmp(table[i].name, name) == 0) {
+            return &table[i];
+        }
+    }
+    return &table[i];
+}
+
+static void
+grow(void)
+{
+    struct intern_slot *old = table;
+    uint32_t           oldSize = tableSize;
+    uint32_t           i;
+    uint32_t           j;
+
+    tableSize = tableSize ? tableSize * 2 : 4096;
+    table = (struct intern_slot *) calloc(tableSize, sizeof *table);
+    alloc_fail_check(table);
+    for (i = 0; i < oldSize; i++) {
+        if (old[i].name == NULL) {
+            continue;
+        }
+        for (j = old[i].hash & (tableSize - 1); table[j].name != NULL;
+             j = (j + 1) & (tableSize - 1)) {
+        }
+        table[j] = old[i];
+    }
+    free(old);
+}
+
+static const char *
+store(const char *name)
+{
+    size_t len = strlen(name) + 1;
+    char   *copy;
+
+    if (len > INTERN_CHUNK / 4) {
+        copy = strdup(name);
+        alloc_fail_check(copy);
+        return copy;
+    }
+    if (chunk == NULL || chunkUsed + len > INTERN_CHUNK) {
+        chunk = (char *) malloc(INTERN_CHUNK);
+        alloc_fail_check(chunk);
+        chunkUsed = 0;
+    }
+    copy = chunk + chunkUsed;
+    memcpy(copy, name, len);
+    chunkUsed += len;
+    return copy;
+}
+
+const char *
+intern(const char *name, uint32_t *id)
+{
+    struct intern_slot *slot;
+    uint32_t           hash = (uint32_t) fnv1a(name, strlen(name));
+
+    pthread_rwlock_rdlock(&internLock);
+    slot = lookup(name, hash);
+    if (slot != NULL && slot->name != NULL) {
+        *id = slot->id;
+        pthread_rwlock_unlock(&internLock);
+        return slot->name;
+    }
+    pthread_rwlock_unlock(&internLock);
+
+    // first sighting - another poller may have beaten us to it
+    pthread_rwlock_wrlock(&internLock);
+    if ((count + 1) * 2 > tableSize) {
+        grow();
+    }
+    slot = lookup(name, hash);
+    if (slot->name == NULL) {
+        slot->name = store(name);
+        slot->hash = hash;
+        slot->id = count++;
+    }
+    *id = slot->id;
+    pthread_rwlock_unlock(&internLock);
+    return slot->name;
+}
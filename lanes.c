@@ -0,0 +1,194 @@
+// ========================================================================
+//
+//  Project   : statsproxy 
+//
+//  Version   : 1.0
+//
+//  Copyright :
+//
+//      Software License Agreement (BSD License)
+//
+//      Copyright (c) 2009, Gear Six, Inc.
+//      All rights reserved.
+//
+//      Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are
+//      met:
+//
+//      * Redistributions of source code must retain the above copyright
+//        notice, this list of conditions and the following disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following disclaimer
+//        in the documentation and/or other materials provided with the
+//        distribution.
+//
+//      * Neither the name of Gear Six, Inc. nor the names of its
+//        contributors may be used to endorse or promote products derived from
+//        this software without specific prior written permission.The Gear Six logo, 
+//        which is provided in the source code and appears on the user interface 
+//        to identify Gear Six, Inc. as the originator of the software program, is 
+//        a trademark of Gear Six, Inc. and can be used only in unaltered form and 
+//        only for purposes of such identification.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// ========================================================================
+//
+#include <stdio.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "queue.h"
+#include "statsproxy.h"
+#include "proxylog.h"
+#include "lanes.h"
+
+static const char *laneNames[NUM_LANES] = {
+    "raw", "html", "heavy", "stream"
+};
+static const int  laneLimits[NUM_LANES] = {
+    DEFAULT_RAW_LANE_LIMIT,
+    DEFAULT_HTML_LANE_LIMIT,
+    DEFAULT_HEAVY_LANE_LIMIT,
+    DEFAULT_STREAM_LANE_LIMIT
+};
+
+// set up the default lanes (called before the config is parsed)
+void
+lanes_init(system_statsproxy_settings_t *sys)
+{
+    int i;
+
+    for (i = 0; i < NUM_LANES; i++) {
+        sys->lanes[i].name = laneNames[i];
+        sys->lanes[i].type = (enum lane_type) i;
+        sys->lanes[i].limit = laneLimits[i];
+        sys->lanes[i].queue_ms = DEFAULT_LANE_QUEUE_MS;
+        sys->lanes[i].rate = 0;  // unlimited
+        sys->lanes[i].burst = 0;
+        sys->lanes[i].active = 0;
+        sys->lanes[i].rejected = 0;
+        sys->lanes[i].limited = 0;
+        pthread_mutex_init(&sys->lanes[i].lock, NULL);
+        pthread_cond_init(&sys->lanes[i].cv, NULL);
+    }
+    TAILQ_INIT(&sys->laneUris);
+}
+
+// look up a lane by its config name
+struct lane *
+lane_find(system_statsproxy_settings_t *sys, const char *name)
+{
+    int i;
+
+    for (i = 0; i < NUM_LANES; i++) {
+        if (strcmp(sys->lanes[i].name, name) == 0) {
+            return &sys->lanes[i];
+        }
+    }
+    return NULL;
+}
+
+// add a config override placing an http uri into a lane
+void
+addLaneUri(system_statsproxy_settings_t *sys, struct lane *lane,
+           const char *uri)
+{
+    struct lane_uri *u;
+
+    u = (struct lane_uri *) calloc(1, sizeof *u);
+    alloc_fail_check(u);
+    u->uri = strdup(uri);
+    alloc_fail_check(u->uri);
+    u->lane = lane;
+    TAILQ_INSERT_TAIL(&sys->laneUris, u, next);
+}
+
+// pick the lane for a request
+struct lane *
+lane_classify(proxyclient_t *clnt, const char *uri, bool_t stream)
+{
+    system_statsproxy_settings_t *sys = &clnt->bep->config->sys;
+    struct lane_uri              *lane_uri;
+    struct confed_uri            *system_uri;
+
+    // long lived subscriptions hold their slot for the whole connection
+    if (stream) {
+        return &sys->lanes[LANE_STREAM];
+    }
+
+    // scrapers never queue behind html renders
+    if (clnt->type == MEMCACHE_CLIENT) {
+        return &sys->lanes[LANE_RAW];
+    }
+
+    TAILQ_FOREACH(lane_uri, &sys->laneUris, next) {
+        if (strcmp(lane_uri->uri, uri) == 0) {
+            return lane_uri->lane;
+        }
+    }
+    TAILQ_FOREACH(system_uri, &sys->uris, next) {
+        if (strcmp(system_uri->uri, uri) == 0) {
+            return &sys->lanes[system_uri->lane];
+        }
+    }
+    return &sys->lanes[LANE_HTML];
+}
+
+// wait for a free slot in the lane
+int
+lane_enter(struct lane *lane)
+{
+    int             err = 0;
+    struct timeval  now;
+    struct timespec deadline;
+
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + lane->queue_ms / NUM_MSECS_PER_SEC;
+    deadline.tv_nsec = now.tv_usec * 1000 +
+                       (lane->queue_ms % NUM_MSECS_PER_SEC) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&lane->lock);
+    while (lane->active >= lane->limit && err == 0) {
+        err = pthread_cond_timedwait(&lane->cv, &lane->lock, &deadline);
+    }
+    if (err == 0) {
+        lane->active++;
+    } else {
+        lane->rejected++;
+    }
+    pthread_mutex_unlock(&lane->lock);
+    return err;
+}
+
+// give back a slot taken with lane_enter()
+void
+lane_exit(struct lane *lane)
+{
+    pthread_mutex_lock(&lane->lock);
+    assert(lane->active > 0);
+    lane->active--;
+    pthread_cond_signal(&lane->cv);
+    pthread_mutex_unlock(&lane->lock);
+}
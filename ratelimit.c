@@ -0,0 +1,171 @@
+// ========================================================================
+//
+//  Project   : statsproxy 
+//
+//  Version   : 1.0
+//
+//  Copyright :
+//
+//      Software License Agreement (BSD License)
+//
+//      Copyright (c) 2009, Gear Six, Inc.
+//      All rights reserved.
+//
+//      Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are
+//      met:
+//
+//      * Redistributions of source code must retain the above copyright
+//        notice, this list of conditions and the following disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following disclaimer
+//        in the documentation and/or other materials provided with the
+//        distribution.
+//
+//      * Neither the name of Gear Six, Inc. nor the names of its
+//        contributors may be used to endorse or promote products derived from
+//        this software without specific prior written permission.The Gear Six logo, 
+//        which is provided in the source code and appears on the user interface 
+//        to identify Gear Six, Inc. as the originator of the software program, is 
+//        a trademark of Gear Six, Inc. and can be used only in unaltered form and 
+//        only for purposes of such identification.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// ========================================================================
+//
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <time.h>
+
+#include "queue.h"
+#include "statsproxy.h"
+#include "ratelimit.h"
+
+#define RL_TOKEN 1000          // bucket levels are kept in millitokens
+
+// one bucket - 16 bytes, a group is two cache lines
+struct rl_bucket {
+    uint32_t                     addr;      // client address
+    uint8_t                      lane;      // lane type
+    uint8_t                      used;      // slot in use
+    uint16_t                     pad;
+    uint32_t                     tokens;    // millitokens left
+    uint32_t                     stamp;     // ms timestamp of last refill
+};
+
+static struct rl_bucket rlTable[RL_TABLE_SIZE];
+static pthread_mutex_t  rlLocks[RL_STRIPES];
+static pthread_once_t   rlOnce = PTHREAD_ONCE_INIT;
+
+static void
+ratelimit_init(void)
+{
+    int i;
+
+    for (i = 0; i < RL_STRIPES; i++) {
+        pthread_mutex_init(&rlLocks[i], NULL);
+    }
+}
+
+// millisecond monotonic clock, truncated - only deltas are used
+static uint32_t
+rl_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t) (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static uint32_t
+rl_hash(uint32_t addr, uint8_t lane)
+{
+    uint32_t h = addr ^ ((uint32_t) lane << 24);
+
+    // murmur3 finalizer
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+// take one token from the client's bucket for this lane
+bool_t
+ratelimit_allow(struct lane *lane, uint32_t addr)
+{
+    int              i;
+    int              group;
+    bool_t           allow;
+    uint32_t         now;
+    uint64_t         level;
+    uint64_t         burst;
+    struct rl_bucket *bucket = NULL;
+    struct rl_bucket *stalest = NULL;
+    struct rl_bucket *base;
+
+    if (lane->rate == 0) {
+        return TRUE;
+    }
+    pthread_once(&rlOnce, ratelimit_init);
+
+    now = rl_now();
+    group = rl_hash(addr, lane->type) & (RL_TABLE_SIZE / RL_GROUP_SIZE - 1);
+    base = &rlTable[group * RL_GROUP_SIZE];
+    burst = (uint64_t) lane->burst * RL_TOKEN;
+
+    pthread_mutex_lock(&rlLocks[group % RL_STRIPES]);
+    for (i = 0; i < RL_GROUP_SIZE; i++) {
+        if (base[i].used && base[i].addr == addr &&
+            base[i].lane == lane->type) {
+            bucket = &base[i];
+            break;
+        }
+        if (stalest == NULL || !base[i].used ||
+            (stalest->used &&
+             now - base[i].stamp > now - stalest->stamp)) {
+            stalest = &base[i];
+        }
+    }
+    if (bucket == NULL) {
+        // new client (or recycled bucket) starts with a full burst
+        bucket = stalest;
+        bucket->addr = addr;
+        bucket->lane = lane->type;
+        bucket->used = TRUE;
+        bucket->tokens = burst;
+        bucket->stamp = now;
+    }
+
+    // refill - rate is tokens per second, i.e. millitokens per ms
+    level = bucket->tokens + (uint64_t) (now - bucket->stamp) * lane->rate;
+    bucket->tokens = level > burst ? burst : level;
+    bucket->stamp = now;
+
+    allow = bucket->tokens >= RL_TOKEN;
+    if (allow) {
+        bucket->tokens -= RL_TOKEN;
+    }
+    pthread_mutex_unlock(&rlLocks[group % RL_STRIPES]);
+
+    if (!allow) {
+        __sync_fetch_and_add(&lane->limited, 1);
+    }
+    return allow;
+}
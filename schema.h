@@ -0,0 +1,138 @@
+// ========================================================================
+//
+//  Project   : statsproxy 
+//
+//  Version   : 1.0
+//
+//  Copyright :
+//
+//      Software License Agreement (BSD License)
+//
+//      Copyright (c) 2009, Gear Six, Inc.
+//      All rights reserved.
+//
+//      Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are
+//      met:
+//
+//      * Redistributions of source code must retain the above copyright
+//        notice, this list of conditions and the following disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following disclaimer
+//        in the documentation and/or other materials provided with the
+//        distribution.
+//
+//      * Neither the name of Gear Six, Inc. nor the names of its
+//        contributors may be used to endorse or promote products derived from
+//        this software without specific prior written permission.The Gear Six logo, 
+//        which is provided in the source code and appears on the user interface 
+//        to identify Gear Six, Inc. as the originator of the software program, is 
+//        a trademark of Gear Six, Inc. and can be used only in unaltered form and 
+//        only for purposes of such identification.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// ========================================================================
+//
+
+#ifndef _SCHEMA_H
+#define _SCHEMA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum known_kind {
+    KNOWN_COUNTER,                             // only goes up
+    KNOWN_GAUGE,                               // a current level
+    KNOWN_TEXT                                 // versions, floats and such
+};
+
+// the stats of memcached's general "stats" reply, in name order (checked
+// by schema_check()) - each gets a fixed slot, KNOWN_<name>
+#define KNOWN_STATS(X)                  \
+    X(accepting_conns,       GAUGE)     \
+    X(auth_cmds,             COUNTER)   \
+    X(auth_errors,           COUNTER)   \
+    X(bytes,                 GAUGE)     \
+    X(bytes_read,            COUNTER)   \
+    X(bytes_written,         COUNTER)   \
+    X(cas_badval,            COUNTER)   \
+    X(cas_hits,              COUNTER)   \
+    X(cas_misses,            COUNTER)   \
+    X(cmd_flush,             COUNTER)   \
+    X(cmd_get,               COUNTER)   \
+    X(cmd_set,               COUNTER)   \
+    X(cmd_touch,             COUNTER)   \
+    X(conn_yields,           COUNTER)   \
+    X(connection_structures, GAUGE)     \
+    X(curr_connections,      GAUGE)     \
+    X(curr_items,            GAUGE)     \
+    X(decr_hits,             COUNTER)   \
+    X(decr_misses,           COUNTER)   \
+    X(delete_hits,           COUNTER)   \
+    X(delete_misses,         COUNTER)   \
+    X(evicted_unfetched,     COUNTER)   \
+    X(evictions,             COUNTER)   \
+    X(expired_unfetched,     COUNTER)   \
+    X(get_hits,              COUNTER)   \
+    X(get_misses,            COUNTER)   \
+    X(hash_bytes,            GAUGE)     \
+    X(hash_is_expanding,     GAUGE)     \
+    X(hash_power_level,      GAUGE)     \
+    X(incr_hits,             COUNTER)   \
+    X(incr_misses,           COUNTER)   \
+    X(libevent,              TEXT)      \
+    X(limit_maxbytes,        GAUGE)     \
+    X(listen_disabled_num,   COUNTER)   \
+    X(pid,                   GAUGE)     \
+    X(pointer_size,          GAUGE)     \
+    X(reclaimed,             COUNTER)   \
+    X(reserved_fds,          GAUGE)     \
+    X(rusage_system,         TEXT)      \
+    X(rusage_user,           TEXT)      \
+    X(threads,               GAUGE)     \
+    X(time,                  GAUGE)     \
+    X(total_connections,     COUNTER)   \
+    X(total_items,           COUNTER)   \
+    X(touch_hits,            COUNTER)   \
+    X(touch_misses,          COUNTER)   \
+    X(uptime,                COUNTER)   \
+    X(version,               TEXT)
+
+#define KNOWN_SLOT(name, kind) KNOWN_##name,
+enum known_stat {
+    KNOWN_STATS(KNOWN_SLOT)
+    NUM_KNOWN_STATS
+};
+#undef KNOWN_SLOT
+
+struct known_stat_def {
+    const char                 *name;
+    enum known_kind            kind;
+};
+
+// indexed by slot
+extern const struct known_stat_def knownStats[NUM_KNOWN_STATS];
+
+// the slot of a stat name, or -1 when it isn't a known one
+int schema_find(const char *name);
+
+// make sure the table is in name order (at startup)
+void schema_check(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SCHEMA_H */
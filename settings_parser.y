@@ -66,6 +66,8 @@
 
 #include "queue.h"
 #include "statsproxy.h"
+#include "lanes.h"
+#include "history.h"
 
 #define YYERROR_VERBOSE
 #define YYPRINT
@@ -74,6 +76,8 @@
 typedef char *charptr;
 
 static int yylex_lineno = 1;
+static struct lane *cur_lane = NULL;   // lane block being parsed
+static char *cur_uri = NULL;           // uri statement being parsed
 static int yylex(FILE *fp);
 static int yyerror(FILE *fp, struct settings *settings, const char *message);
 
@@ -97,6 +101,7 @@ static int yyerror(FILE *fp, struct settings *settings, const char *message);
 %type <double_val> FLOAT
 %type <string_val> STRING
 %type <char_val> CHAR
+%type <int_val> uri_poll_interval
 
 %parse-param {FILE *fp}
 %parse-param {struct settings *settings}
@@ -116,11 +121,115 @@ statements1 : statement
     | statements1 statement
     ;
 
-statement : "uri" STRING ';'
+statement : "uri" STRING
             {
-                addGlobalUri(&settings->global, $2);
+                // the lexer's buffer is reused by the tokens that follow
+                cur_uri = strdup($2);
+            }
+              uri_poll_interval ';'
+            {
+                addGlobalUri(&settings->global, cur_uri, $4);
+                free(cur_uri);
+                cur_uri = NULL;
+            }
+    | "state-file" '=' STRING ';'
+            {
+                settings->sys.state_file = strdup($3);
+            }
+    | "history" '=' INTEGER ';'
+            {
+                if ($3 > HISTORY_MAX_HOURS) {
+                    fprintf(stderr, "history value should be 0 to %d\n",
+                            HISTORY_MAX_HOURS);
+                    YYABORT;
+                }
+                settings->sys.history_hours = (int) $3;
             }
     | proxy_mapping_block
+    | cluster_mapping_block
+    | lane_block
+    ;
+
+uri_poll_interval : /* empty */
+            {
+                $$ = 0;
+            }
+    | "poll-interval" '=' INTEGER
+            {
+                if ($3 == 0 || $3 > MAX_POLL_INTERVAL) {
+                    fprintf(stderr, "poll-interval value should be 1 to %d\n",
+                            MAX_POLL_INTERVAL);
+                    YYABORT;
+                }
+                $$ = $3 * 1000;
+            }
+    ;
+
+lane_block : "lane" STRING
+            {
+                cur_lane = lane_find(&settings->sys, $2);
+                if (cur_lane == NULL) {
+                    fprintf(stderr, "Unknown lane \"%s\" at line %u; expecting "
+                            "[raw | html | heavy | stream]\n", $2, yylex_lineno);
+                    YYABORT;
+                }
+            }
+              '{' lane_statements '}'
+            {
+                if (cur_lane->rate != 0 && cur_lane->burst == 0) {
+                    cur_lane->burst = cur_lane->rate;
+                }
+            }
+    ;
+
+lane_statements : /* empty */
+    | lane_statements1
+    ;
+
+lane_statements1 : lane_statement
+    | lane_statements1 lane_statement
+    ;
+
+lane_statement : "concurrency" '=' INTEGER ';'
+            {
+                cur_lane->limit = $3;
+                if (cur_lane->limit <= 0) {
+                    fprintf(stderr, "concurrency value should be greater "
+                            "than 0\n");
+                    YYABORT;
+                }
+            }
+    | "queue-timeout" '=' INTEGER ';'
+            {
+                cur_lane->queue_ms = $3 * 1000;
+                if (cur_lane->queue_ms <= 0) {
+                    fprintf(stderr, "queue-timeout value should be greater "
+                            "than 0\n");
+                    YYABORT;
+                }
+            }
+    | "rate" '=' INTEGER ';'
+            {
+                cur_lane->rate = $3;
+                if (cur_lane->rate <= 0 || cur_lane->rate > MAX_LANE_BURST) {
+                    fprintf(stderr, "rate value should be between 1 "
+                            "and %d\n", MAX_LANE_BURST);
+                    YYABORT;
+                }
+            }
+    | "burst" '=' INTEGER ';'
+            {
+                cur_lane->burst = $3;
+                if (cur_lane->burst <= 0 || cur_lane->burst > MAX_LANE_BURST) {
+                    fprintf(stderr, "burst value should be between 1 "
+                            "and %d\n", MAX_LANE_BURST);
+                    YYABORT;
+                }
+            }
+    | "uri" STRING ';'
+            {
+                addLaneUri(&settings->sys, cur_lane, $2);
+            }
     ;
 
 proxy_mapping_block : "proxy-mapping" '{'
@@ -129,7 +238,11 @@ proxy_mapping_block : "proxy-mapping" '{'
                 settings->local.read_ms = DEFAULT_TIMEOUT_MS;
                 settings->local.write_ms = DEFAULT_TIMEOUT_MS;
                 settings->local.pollfreq_ms = DEFAULT_POLL_FREQ_MS;
+                settings->local.poll_jitter = DEFAULT_POLL_JITTER;
                 settings->local.refreshfreq_ms = DEFAULT_WEBPAGE_REFRESH_FREQ_MS;
+                settings->local.pool = NULL;
+                settings->local.health_key = NULL;
+                settings->local.health_value_size = 0;
             }
               proxy_mapping_statements
             {
@@ -159,6 +272,37 @@ proxy_mapping_block : "proxy-mapping" '{'
               '}'
 ;
 
+cluster_mapping_block : "cluster-mapping" '{'
+            {
+                settings->local.frontport = 0;
+                settings->local.backhost = NULL;
+                settings->local.backport = 0;
+                settings->local.reporter = NULL;
+                settings->local.pollfreq_ms = DEFAULT_POLL_FREQ_MS;
+                settings->local.poll_jitter = DEFAULT_POLL_JITTER;
+                settings->local.refreshfreq_ms = DEFAULT_WEBPAGE_REFRESH_FREQ_MS;
+                settings->local.pool = NULL;
+                settings->local.health_key = NULL;
+                settings->local.health_value_size = 0;
+            }
+              proxy_mapping_statements
+            {
+                if (settings->local.frontport == 0) {
+                    fprintf(stderr, "Missing front-end at line %u\n",
+                            yylex_lineno);
+                    YYERROR;
+                }
+                if (settings->local.backport != 0) {
+                    fprintf(stderr, "No back-end allowed in a cluster-mapping "
+                            "at line %u\n", yylex_lineno);
+                    YYERROR;
+                }
+                addCluster(settings);
+                settings->local.backport = 0;
+            }
+              '}'
+;
+
 proxy_mapping_statements : /* empty */
     | proxy_mapping_statements1
     ;
@@ -207,12 +351,20 @@ proxy_mapping_statement : "front-end" '=' STRING ';'
             }
     | "poll-interval" '=' INTEGER ';'
             {
+                if ($3 == 0 || $3 > MAX_POLL_INTERVAL) {
+                    fprintf(stderr, "poll-interval value should be 1 to %d\n",
+                            MAX_POLL_INTERVAL);
+                    YYABORT;
+                }
                 settings->local.pollfreq_ms = $3 * 1000;
-                if (settings->local.pollfreq_ms <= 0) {
-                    fprintf(stderr, "poll-interval value should be greater "
-                            "than 0\n");
+            }
+    | "poll-jitter" '=' INTEGER ';'
+            {
+                if ($3 > 100) {
+                    fprintf(stderr, "poll-jitter value should be 0 to 100\n");
                     YYABORT;
                 }
+                settings->local.poll_jitter = (int) $3;
             }
     | "webpage-refresh-interval" '=' INTEGER ';'
             {
@@ -223,6 +375,29 @@ proxy_mapping_statement : "front-end" '=' STRING ';'
                     YYABORT;
                 }
             }
+    | "pool" '=' STRING ';'
+            {
+                settings->local.pool = strdup($3);
+            }
+    | "health-key" '=' STRING ';'
+            {
+                settings->local.health_key = strdup($3);
+                if (strlen($3) == 0 || strlen($3) > MAX_HEALTH_KEY ||
+                    strpbrk($3, " \t\r\n") != NULL) {
+                    fprintf(stderr, "health-key should be 1 to %d characters "
+                            "without spaces\n", MAX_HEALTH_KEY);
+                    YYABORT;
+                }
+            }
+    | "health-value-size" '=' INTEGER ';'
+            {
+                settings->local.health_value_size = $3;
+                if ($3 <= 0 || $3 > MAX_HEALTH_VALUE_SIZE) {
+                    fprintf(stderr, "health-value-size should be 1 to %d\n",
+                            MAX_HEALTH_VALUE_SIZE);
+                    YYABORT;
+                }
+            }
     | "memcache-reporter" '=' STRING ';'
             {
                 settings->local.reporter = strdup($3);
@@ -0,0 +1,222 @@
+// ========================================================================
+//
+//  Project   : statsproxy 
+//
+//  Version   : 1.0
+//
+//  Copyright :
+//
+//      Software License Agreement (BSD License)
+//
+//      Copyright (c) 2009, Gear Six, Inc.
+//      All rights reserved.
+//
+//      Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are
+//      met:
+//
+//      * Redistributions of source code must retain the above copyright
+//        notice, this list of conditions and the following disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following disclaimer
+//        in the documentation and/or other materials provided with the
+//        distribution.
+//
+//      * Neither the name of Gear Six, Inc. nor the names of its
+//        contributors may be used to endorse or promote products derived from
+//        this software without specific prior written permission.The Gear Six logo, 
+//        which is provided in the source code and appears on the user interface 
+//        to identify Gear Six, Inc. as the originator of the software program, is 
+//        a trademark of Gear Six, Inc. and can be used only in unaltered form and 
+//        only for purposes of such identification.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// ========================================================================
+//
+#include <stdio.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <time.h>
+
+#include "queue.h"
+#include "statsproxy.h"
+#include "proxylog.h"
+#include "sketch.h"
+
+#define SKETCH_GAMMA ((1 + SKETCH_ACCURACY) / (1 - SKETCH_ACCURACY))
+
+// one minute of one metric
+struct latency_window {
+    time_t                     minute;         // minute it holds (0: none)
+    struct sketch              sk;             // its sketch
+};
+
+struct latency {
+    pthread_mutex_t            lock;
+    struct latency_window      win[NUM_LATENCY_METRICS][SKETCH_WINDOWS];
+};
+
+void
+sketch_init(struct sketch *sk)
+{
+    memset(sk, 0, sizeof *sk);
+}
+
+void
+sketch_free(struct sketch *sk)
+{
+    free(sk->bins);
+    sketch_init(sk);
+}
+
+static int
+bucketIndex(uint64_t us)
+{
+    return (int) ceil(log((double) us) / log(SKETCH_GAMMA));
+}
+
+// make room for buckets lo..hi
+static void
+growBins(struct sketch *sk, int lo, int hi)
+{
+    int      newOffset;
+    int      newEnd;
+    uint32_t *bins;
+
+    if (sk->nbins > 0 && lo >= sk->offset && hi < sk->offset + sk->nbins) {
+        return;
+    }
+    newOffset = (sk->nbins > 0 && sk->offset < lo) ? sk->offset : lo;
+    newEnd = (sk->nbins > 0 && sk->offset + sk->nbins > hi + 1) ?
+             sk->offset + sk->nbins : hi + 1;
+    bins = (uint32_t *) calloc(newEnd - newOffset, sizeof *bins);
+    alloc_fail_check(bins);
+    if (sk->nbins > 0) {
+        memcpy(bins + (sk->offset - newOffset), sk->bins,
+               sk->nbins * sizeof *bins);
+    }
+    free(sk->bins);
+    sk->bins = bins;
+    sk->offset = newOffset;
+    sk->nbins = newEnd - newOffset;
+}
+
+void
+sketch_add(struct sketch *sk, uint64_t us)
+{
+    int i;
+
+    sk->count++;
+    if (us == 0) {
+        sk->zero++;
+        return;
+    }
+    i = bucketIndex(us);
+    growBins(sk, i, i);
+    sk->bins[i - sk->offset]++;
+}
+
+void
+sketch_merge(struct sketch *into, const struct sketch *from)
+{
+    int i;
+
+    if (from->nbins > 0) {
+        growBins(into, from->offset, from->offset + from->nbins - 1);
+        for (i = 0; i < from->nbins; i++) {
+            into->bins[from->offset - into->offset + i] += from->bins[i];
+        }
+    }
+    into->zero += from->zero;
+    into->count += from->count;
+}
+
+double
+sketch_quantile(const struct sketch *sk, double q)
+{
+    uint64_t rank;
+    uint64_t seen;
+    int      i;
+
+    if (sk->count == 0) {
+        return 0;
+    }
+    rank = (uint64_t) (q * (sk->count - 1));
+    seen = sk->zero;
+    if (rank < seen) {
+        return 0;
+    }
+    for (i = 0; i < sk->nbins; i++) {
+        seen += sk->bins[i];
+        if (rank < seen) {
+            // the middle of the bucket, within the accuracy of both ends
+            return 2 * pow(SKETCH_GAMMA, sk->offset + i) / (SKETCH_GAMMA + 1);
+        }
+    }
+    return 2 * pow(SKETCH_GAMMA, sk->offset + sk->nbins - 1) /
+           (SKETCH_GAMMA + 1);
+}
+
+struct latency *
+latency_new(void)
+{
+    struct latency *lat;
+
+    lat = (struct latency *) calloc(1, sizeof *lat);
+    alloc_fail_check(lat);
+    pthread_mutex_init(&lat->lock, NULL);
+    return lat;
+}
+
+void
+latency_record(struct latency *lat, enum latency_metric metric, uint64_t us)
+{
+    time_t                minute = time(NULL) / 60;
+    struct latency_window *w = &lat->win[metric][minute % SKETCH_WINDOWS];
+
+    pthread_mutex_lock(&lat->lock);
+    if (w->minute != minute) {
+        // the window comes round again - drop what it held
+        sketch_free(&w->sk);
+        w->minute = minute;
+    }
+    sketch_add(&w->sk, us);
+    pthread_mutex_unlock(&lat->lock);
+}
+
+void
+latency_merge(struct latency *lat, enum latency_metric metric, int minutes,
+              struct sketch *into)
+{
+    time_t                minute = time(NULL) / 60;
+    struct latency_window *w;
+    int                   i;
+
+    if (minutes > SKETCH_WINDOWS) {
+        minutes = SKETCH_WINDOWS;
+    }
+    pthread_mutex_lock(&lat->lock);
+    for (i = 0; i < SKETCH_WINDOWS; i++) {
+        w = &lat->win[metric][i];
+        if (w->minute != 0 && w->minute > minute - minutes) {
+            sketch_merge(into, &w->sk);
+        }
+    }
+    pthread_mutex_unlock(&lat->lock);
+}
@@ -0,0 +1,99 @@
+// ========================================================================
+//
+//  Project   : statsproxy 
+//
+//  Version   : 1.0
+//
+//  Copyright :
+//
+//      Software License Agreement (BSD License)
+//
+//      Copyright (c) 2009, Gear Six, Inc.
+//      All rights reserved.
+//
+//      Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are
+//      met:
+//
+//      * Redistributions of source code must retain the above copyright
+//        notice, this list of conditions and the following disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following disclaimer
+//        in the documentation and/or other materials provided with the
+//        distribution.
+//
+//      * Neither the name of Gear Six, Inc. nor the names of its
+//        contributors may be used to endorse or promote products derived from
+//        this software without specific prior written permission.The Gear Six logo, 
+//        which is provided in the source code and appears on the user interface 
+//        to identify Gear Six, Inc. as the originator of the software program, is 
+//        a trademark of Gear Six, Inc. and can be used only in unaltered form and 
+//        only for purposes of such identification.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// ========================================================================
+//
+
+#ifndef _SKETCH_H
+#define _SKETCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// relative accuracy of the quantiles (1%) and how many minutes of
+// per-minute windows each backend keeps
+#define SKETCH_ACCURACY 0.01
+#define SKETCH_WINDOWS  60
+
+// log-bucketed quantile sketch (DDSketch style) of microsecond latencies.
+// Bucket i counts values in (gamma^(i-1), gamma^i]; only the range of
+// buckets actually hit is allocated.  Sketches merge by adding buckets.
+struct sketch {
+    int                        offset;         // index of bins[0]
+    int                        nbins;          // number of bins
+    uint32_t                   *bins;          // counts per bucket
+    uint64_t                   zero;           // values below 1us
+    uint64_t                   count;          // values added
+};
+
+// the whole health probe, a stats poll, the health probe's steps, and how
+// late the poller woke up for its deadline
+enum latency_metric {
+    LATENCY_LIVENESS, LATENCY_POLL, LATENCY_SET, LATENCY_GET, LATENCY_DELETE,
+    LATENCY_DRIFT, NUM_LATENCY_METRICS
+};
+
+void sketch_init(struct sketch *sk);
+void sketch_free(struct sketch *sk);
+void sketch_add(struct sketch *sk, uint64_t us);
+void sketch_merge(struct sketch *into, const struct sketch *from);
+
+// value (us) at quantile q (0..1) - 0 for an empty sketch
+double sketch_quantile(const struct sketch *sk, double q);
+
+// a backend's latencies, one sketch per metric per minute
+struct latency *latency_new(void);
+void latency_record(struct latency *lat, enum latency_metric metric,
+                    uint64_t us);
+
+// merge the last 'minutes' minutes of a metric into a sketch
+void latency_merge(struct latency *lat, enum latency_metric metric,
+                   int minutes, struct sketch *into);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SKETCH_H */
@@ -0,0 +1,359 @@
+// ========================================================================
+//
+//  Project   : statsproxy 
+//
+//  Version   : 1.0
+//
+//  Copyright :
+//
+//      Software License Agreement (BSD License)
+//
+//      Copyright (c) 2009, Gear Six, Inc.
+//      All rights reserved.
+//
+//      Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are
+//      met:
+//
+//      * Redistributions of source code must retain the above copyright
+//        notice, this list of conditions and the following disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following disclaimer
+//        in the documentation and/or other materials provided with the
+//        distribution.
+//
+//      * Neither the name of Gear Six, Inc. nor the names of its
+//        contributors may be used to endorse or promote products derived from
+//        this software without specific prior written permission.The Gear Six logo, 
+//        which is provided in the source code and appears on the user interface 
+//        to identify Gear Six, Inc. as the originator of the software program, is 
+//        a trademark of Gear Six, Inc. and can be used only in unaltered form and 
+//        only for purposes of such identification.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// ========================================================================
+//
+#include <stdio.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+
+#include "queue.h"
+#include "statsproxy.h"
+#include "proxylog.h"
+#include "intern.h"
+
+// copy a string into the builder's arena, returning its offset
+static size_t
+arenaAdd(struct stats_builder *b, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    size_t off = b->used;
+
+    if (b->used + len > b->arenaSize) {
+        b->arenaSize = (b->arenaSize == 0) ? 4096 : b->arenaSize * 2;
+        if (b->arenaSize < b->used + len) {
+            b->arenaSize = b->used + len;
+        }
+        b->arena = (char *) realloc(b->arena, b->arenaSize);
+        alloc_fail_check(b->arena);
+    }
+    memcpy(b->arena + off, str, len);
+    b->used += len;
+    return off;
+}
+
+// the slab class of a per slab stat ("items:<class>:<field>" or
+// "<class>:<field>"), or -1
+static int
+slabStat(const char *name, const char **field)
+{
+    const char *p = name;
+    int        slab = 0;
+
+    if (strncmp(p, SLAB_ITEMS_PREFIX, strlen(SLAB_ITEMS_PREFIX)) == 0) {
+        p += strlen(SLAB_ITEMS_PREFIX);
+    }
+    if (!isdigit((unsigned char) *p)) {
+        return -1;
+    }
+    for (; isdigit((unsigned char) *p); p++) {
+        slab = slab * 10 + (*p - '0');
+        if (slab >= MAX_SLAB_CLASSES) {
+            return -1;
+        }
+    }
+    if (*p != ':' || p[1] == '\0') {
+        return -1;
+    }
+    *field = p + 1;
+    return slab;
+}
+
+void
+stats_add(struct stats_builder *b, const char *name, enum stats_type type,
+          const char *str, uint64_t val)
+{
+    struct stats_slot *slot;
+    const char        *field;
+    uint32_t          fieldId;
+
+    if (b->count == b->size) {
+        b->size = (b->size == 0) ? 64 : b->size * 2;
+        b->slots = (struct stats_slot *)
+            realloc(b->slots, b->size * sizeof *b->slots);
+        alloc_fail_check(b->slots);
+    }
+    slot = &b->slots[b->count++];
+    slot->type = type;
+    slot->name = intern(name, &slot->id);
+    slot->slab = slabStat(name, &field);
+    slot->field = (slot->slab >= 0) ? intern(field, &fieldId) : NULL;
+    if (type == ALPHA) {
+        slot->str = arenaAdd(b, str);
+        slot->value = 0;
+    } else {
+        slot->str = 0;
+        slot->value = val;
+    }
+}
+
+void
+stats_discard(struct stats_builder *b)
+{
+    b->count = 0;
+    b->used = 0;
+}
+
+static int
+compareStatNames(const void *a, const void *b)
+{
+    return strcmp((*(struct stats_entry **) a)->name,
+                  (*(struct stats_entry **) b)->name);
+}
+
+// point the schema slots at the known stats - the index and the schema
+// are both in name order, so it's one merge pass. Known counters and
+// gauges are parsed here, once, rather than wherever they're read.
+static void
+bindKnown(struct stats_snapshot *snap)
+{
+    struct stats_entry *entry;
+    const char         *str;
+    size_t             len;
+    int                i = 0;
+    int                k = 0;
+    int                cmp;
+
+    memset(snap->known, 0, sizeof snap->known);
+    while (i < snap->count && k < NUM_KNOWN_STATS) {
+        entry = snap->index[i];
+        cmp = strcmp(entry->name, knownStats[k].name);
+        if (cmp < 0) {
+            i++;
+            continue;
+        } else if (cmp > 0) {
+            k++;
+            continue;
+        }
+        entry->known = k;
+        snap->known[k] = entry;
+        if (knownStats[k].kind != KNOWN_TEXT && entry->type == ALPHA) {
+            str = entry->v.valueStr;
+            len = strspn(str, "0123456789");
+            if (len > 0 && len < 20 && str[len] == '\0') {
+                entry->type = UINT64;
+                entry->v.value = strtoull(str, NULL, 10);
+            }
+        }
+        i++;
+        k++;
+    }
+}
+
+// the column of a slab field, adding it when there's room
+static int
+fieldColumn(const char **fields, int *nfields, const char *field)
+{
+    int f;
+
+    for (f = 0; f < *nfields; f++) {
+        if (fields[f] == field) {
+            return f;
+        }
+    }
+    if (*nfields == MAX_SLAB_FIELDS) {
+        return -1;
+    }
+    fields[(*nfields)++] = field;
+    return f;
+}
+
+int
+slab_field(struct slab_matrix *m, const char *field)
+{
+    int f;
+
+    for (f = 0; f < m->nfields; f++) {
+        if (strcmp(m->field[f], field) == 0) {
+            return f;
+        }
+    }
+    return -1;
+}
+
+uint64_t
+slab_total(struct slab_matrix *m, int f)
+{
+    uint64_t *col = &m->vals[f * m->nslabs];
+    uint64_t sum = 0;
+    int      r;
+
+    for (r = 0; r < m->nslabs; r++) {
+        sum += col[r];
+    }
+    return sum;
+}
+
+// lay the snapshot out in one allocation - header, entries in reply order,
+// the name index, the slab matrix if there are per slab stats, then the
+// strings - and sort the index
+struct stats_snapshot *
+stats_finish(struct stats_builder *b, int general)
+{
+    struct stats_snapshot *snap;
+    struct stats_entry    *entry;
+    struct stats_slot     *slot;
+    struct slab_matrix    *m = NULL;
+    const char            *fields[MAX_SLAB_FIELDS];
+    const char            *prefix = "";
+    const char            *str;
+    int                   rowOf[MAX_SLAB_CLASSES];
+    int                   nslabs = 0;
+    int                   nfields = 0;
+    int                   cell;
+    int                   f;
+    int                   i;
+    char                  *arena;
+    size_t                size;
+    size_t                len;
+
+    // the slab classes and fields there are
+    memset(rowOf, 0, sizeof rowOf);
+    for (i = 0; i < b->count; i++) {
+        slot = &b->slots[i];
+        if (slot->slab >= 0 && fieldColumn(fields, &nfields, slot->field) >= 0) {
+            rowOf[slot->slab] = 1;
+            if (strncmp(slot->name, SLAB_ITEMS_PREFIX,
+                        strlen(SLAB_ITEMS_PREFIX)) == 0) {
+                prefix = SLAB_ITEMS_PREFIX;
+            }
+        }
+    }
+    for (i = 0; i < MAX_SLAB_CLASSES; i++) {
+        rowOf[i] = rowOf[i] ? nslabs++ : -1;
+    }
+
+    size = offsetof(struct stats_snapshot, entries) +
+           b->count * sizeof(struct stats_entry) +
+           b->count * sizeof(struct stats_entry *);
+    if (nslabs > 0) {
+        size += sizeof(struct slab_matrix) +
+                nslabs * nfields * sizeof(uint64_t) +
+                nfields * sizeof(const char *) + nslabs * sizeof(int) +
+                nslabs * nfields;
+    }
+    snap = (struct stats_snapshot *) malloc(size + b->used);
+    alloc_fail_check(snap);
+    snap->count = b->count;
+    snap->index = (struct stats_entry **) &snap->entries[b->count];
+    if (nslabs > 0) {
+        m = (struct slab_matrix *) &snap->index[b->count];
+        m->nslabs = nslabs;
+        m->nfields = nfields;
+        m->prefix = prefix;
+        m->vals = (uint64_t *) (m + 1);
+        m->field = (const char **) &m->vals[nslabs * nfields];
+        m->slab = (int *) &m->field[nfields];
+        m->have = (uint8_t *) &m->slab[nslabs];
+        memcpy(m->field, fields, nfields * sizeof *fields);
+        for (i = 0; i < MAX_SLAB_CLASSES; i++) {
+            if (rowOf[i] >= 0) {
+                m->slab[rowOf[i]] = i;
+            }
+        }
+        memset(m->vals, 0, nslabs * nfields * sizeof *m->vals);
+        memset(m->have, 0, nslabs * nfields);
+    }
+    snap->slabs = m;
+    arena = (char *) snap + size;
+    if (b->used > 0) {
+        memcpy(arena, b->arena, b->used);
+    }
+
+    for (i = 0; i < b->count; i++) {
+        slot = &b->slots[i];
+        entry = &snap->entries[i];
+        entry->type = slot->type;
+        entry->known = -1;
+        entry->id = slot->id;
+        entry->slab = -1;
+        entry->name = slot->name;
+        if (entry->type == ALPHA) {
+            entry->v.valueStr = arena + slot->str;
+        } else {
+            entry->v.value = slot->value;
+        }
+        snap->index[i] = entry;
+
+        // numeric per slab stats go into their matrix cell
+        if (m == NULL || slot->slab < 0 ||
+            (f = fieldColumn(fields, &nfields, slot->field)) < 0) {
+            continue;
+        }
+        cell = f * nslabs + rowOf[slot->slab];
+        if (entry->type == UINT64) {
+            m->vals[cell] = entry->v.value;
+        } else {
+            str = entry->v.valueStr;
+            len = strspn(str, "0123456789");
+            if (len == 0 || len >= 20 || str[len] != '\0') {
+                continue;
+            }
+            m->vals[cell] = strtoull(str, NULL, 10);
+        }
+        m->have[cell] = 1;
+        entry->slab = slot->slab;
+    }
+    qsort(snap->index, snap->count, sizeof *snap->index, compareStatNames);
+
+    for (i = 1; i < snap->count; i++) {
+        if (snap->index[i - 1]->id == snap->index[i]->id) {
+            proxylog(LOG_ERR, "dupe stat %s detected", snap->index[i]->name);
+        }
+    }
+    if (general) {
+        bindKnown(snap);
+    } else {
+        memset(snap->known, 0, sizeof snap->known);
+    }
+    stats_discard(b);
+    return snap;
+}
@@ -0,0 +1,551 @@
+// ========================================================================
+//
+//  Project   : statsproxy 
+//
+//  Version   : 1.0
+//
+//  Copyright :
+//
+//      Software License Agreement (BSD License)
+//
+//      Copyright (c) 2009, Gear Six, Inc.
+//      All rights reserved.
+//
+//      Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are
+//      met:
+//
+//      * Redistributions of source code must retain the above copyright
+//        notice, this list of conditions and the following disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following disclaimer
+//        in the documentation and/or other materials provided with the
+//        distribution.
+//
+//      * Neither the name of Gear Six, Inc. nor the names of its
+//        contributors may be used to endorse or promote products derived from
+//        this software without specific prior written permission.The Gear Six logo, 
+//        which is provided in the source code and appears on the user interface 
+//        to identify Gear Six, Inc. as the originator of the software program, is 
+//        a trademark of Gear Six, Inc. and can be used only in unaltered form and 
+//        only for purposes of such identification.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// ========================================================================
+//
+#include <stdio.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "queue.h"
+#include "statsproxy.h"
+#include "proxylog.h"
+#include "top.h"
+#include "history.h"
+#include "state.h"
+
+// The file is a header page followed by two regions of capacity bytes.
+// A save goes to the region holding the older save: the data is written
+// and synced first, then its descriptor in the header.  Loading takes the
+// newest region whose checksum matches, so a save cut short by a crash
+// only ever costs that save.
+#define STATE_MAGIC        0x3145544154535053ULL   // "SPSTATE1"
+#define STATE_VERSION      2
+#define STATE_HEADER_SIZE  4096
+#define STATE_MIN_CAPACITY (1024 * 1024)
+
+struct state_desc {
+    uint64_t                   seq;            // save number (0: empty)
+    uint64_t                   len;            // bytes saved
+    uint64_t                   sum;            // FNV-1a of the bytes
+};
+
+struct state_header {
+    uint64_t                   magic;
+    uint64_t                   version;
+    uint64_t                   capacity;       // bytes per region
+    struct state_desc          desc[2];        // the regions
+};
+
+static pthread_mutex_t stateLock = PTHREAD_MUTEX_INITIALIZER;
+static char            *statePath;             // the file
+static uint8_t         *stateMap;              // the file, mapped
+static size_t          stateMapLen;            // bytes mapped
+
+void
+state_put_u64(FILE *fp, uint64_t v)
+{
+    fwrite(&v, sizeof v, 1, fp);
+}
+
+void
+state_put_bytes(FILE *fp, const void *data, size_t len)
+{
+    fwrite(data, 1, len, fp);
+}
+
+void
+state_put_str(FILE *fp, const char *str)
+{
+    size_t len = strlen(str);
+
+    state_put_u64(fp, len);
+    state_put_bytes(fp, str, len);
+}
+
+void
+state_get_bytes(struct state_reader *r, void *data, size_t len)
+{
+    if (r->err || (size_t) (r->end - r->p) < len) {
+        r->err = TRUE;
+        memset(data, 0, len);
+        return;
+    }
+    memcpy(data, r->p, len);
+    r->p += len;
+}
+
+uint64_t
+state_get_u64(struct state_reader *r)
+{
+    uint64_t v;
+
+    state_get_bytes(r, &v, sizeof v);
+    return v;
+}
+
+char *
+state_get_str(struct state_reader *r)
+{
+    uint64_t len = state_get_u64(r);
+    char     *str;
+
+    if (r->err || (uint64_t) (r->end - r->p) < len) {
+        r->err = TRUE;
+        return NULL;
+    }
+    str = (char *) malloc(len + 1);
+    alloc_fail_check(str);
+    memcpy(str, r->p, len);
+    str[len] = '\0';
+    r->p += len;
+    return str;
+}
+
+static struct state_header *
+header(void)
+{
+    return (struct state_header *) stateMap;
+}
+
+static uint8_t *
+region(int i)
+{
+    return stateMap + STATE_HEADER_SIZE + i * header()->capacity;
+}
+
+// map a state file, starting it afresh (with room for capacity bytes per
+// region) when it's new, from another version, or fresh is set
+static int
+mapState(const char *path, uint64_t capacity, bool_t fresh)
+{
+    int                 fd;
+    struct stat         st;
+    struct state_header hdr;
+    size_t              len;
+
+    fd = open(path, O_RDWR | O_CREAT | (fresh ? O_TRUNC : 0), 0644);
+    if (fd < 0) {
+        proxylog(LOG_ERR, "state file %s: %s", path, strerror(errno));
+        return errno;
+    }
+    memset(&hdr, 0, sizeof hdr);
+    if (fstat(fd, &st) == 0 && st.st_size >= STATE_HEADER_SIZE &&
+        pread(fd, &hdr, sizeof hdr, 0) == sizeof hdr &&
+        hdr.magic == STATE_MAGIC && hdr.version == STATE_VERSION &&
+        (uint64_t) st.st_size == STATE_HEADER_SIZE + 2 * hdr.capacity) {
+        len = st.st_size;
+        fresh = FALSE;
+    } else {
+        len = STATE_HEADER_SIZE + 2 * capacity;
+        fresh = TRUE;
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, len) != 0) {
+            proxylog(LOG_ERR, "state file %s: %s", path, strerror(errno));
+            close(fd);
+            return errno;
+        }
+    }
+
+    stateMap = (uint8_t *) mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                fd, 0);
+    close(fd);
+    if (stateMap == MAP_FAILED) {
+        proxylog(LOG_ERR, "state file %s: %s", path, strerror(errno));
+        stateMap = NULL;
+        return errno;
+    }
+    stateMapLen = len;
+    if (fresh) {
+        memset(stateMap, 0, STATE_HEADER_SIZE);
+        header()->magic = STATE_MAGIC;
+        header()->version = STATE_VERSION;
+        header()->capacity = capacity;
+        msync(stateMap, STATE_HEADER_SIZE, MS_SYNC);
+    }
+    return 0;
+}
+
+static void
+unmapState(void)
+{
+    if (stateMap != NULL) {
+        munmap(stateMap, stateMapLen);
+        stateMap = NULL;
+    }
+}
+
+// write a save into a region - data first, then its descriptor
+static void
+writeRegion(int i, const uint8_t *data, size_t len, uint64_t seq)
+{
+    struct state_desc *desc = &header()->desc[i];
+    size_t            page = sysconf(_SC_PAGESIZE);
+
+    desc->seq = 0;
+    msync(stateMap, STATE_HEADER_SIZE, MS_SYNC);
+    memcpy(region(i), data, len);
+    msync(region(i), (len + page - 1) / page * page, MS_SYNC);
+    desc->len = len;
+    desc->sum = fnv1a(data, len);
+    desc->seq = seq;
+    msync(stateMap, STATE_HEADER_SIZE, MS_SYNC);
+}
+
+// the region holding the newest intact save, or -1
+static int
+newestRegion(void)
+{
+    struct state_desc *desc;
+    int               best = -1;
+    int               i;
+
+    for (i = 0; i < 2; i++) {
+        desc = &header()->desc[i];
+        if (desc->seq == 0 || desc->len > header()->capacity ||
+            fnv1a(region(i), desc->len) != desc->sum) {
+            continue;
+        }
+        if (best < 0 || desc->seq > header()->desc[best].seq) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+// a backend's name in the state file
+static void
+backendKey(backend_t *bep, char *key, size_t len)
+{
+    snprintf(key, len, "%s:%u>%s:%u", bep->settings.fronthost,
+             bep->settings.frontport, bep->settings.backhost,
+             bep->settings.backport);
+}
+
+static void
+saveBackend(backend_t *bep, FILE *fp)
+{
+    struct uri_entry   *uri_entry;
+    struct stats_entry *entry;
+    char               key[MAXREQSZ];
+    uint64_t           count;
+    int                i;
+
+    backendKey(bep, key, sizeof key);
+    state_put_str(fp, key);
+
+    rdlock(bep);
+    state_put_u64(fp, bep->generation);
+    count = 0;
+    TAILQ_FOREACH(uri_entry, &bep->uris, next) {
+        count++;
+    }
+    state_put_u64(fp, count);
+    TAILQ_FOREACH(uri_entry, &bep->uris, next) {
+        state_put_str(fp, uri_entry->uri);
+        state_put_u64(fp, uri_entry->generation);
+        state_put_u64(fp, uri_entry->published_ms);
+        state_put_u64(fp, uri_entry->lastpoll);
+        state_put_u64(fp, uri_entry->stats->count);
+        for (i = 0; i < uri_entry->stats->count; i++) {
+            entry = &uri_entry->stats->entries[i];
+            state_put_str(fp, entry->name);
+            state_put_u64(fp, entry->type);
+            if (entry->type == UINT64) {
+                state_put_u64(fp, entry->v.value);
+            } else {
+                state_put_str(fp, entry->v.valueStr);
+            }
+        }
+    }
+    unlock(bep);
+
+    history_save(bep->history, fp);
+}
+
+static backend_t *
+findBackend(struct settings *settings, const char *key)
+{
+    backend_t *bep;
+    char      name[MAXREQSZ];
+
+    TAILQ_FOREACH(bep, &settings->proxies, next) {
+        backendKey(bep, name, sizeof name);
+        if (strcmp(name, key) == 0) {
+            return bep;
+        }
+    }
+    TAILQ_FOREACH(bep, &settings->clusters, next) {
+        backendKey(bep, name, sizeof name);
+        if (strcmp(name, key) == 0) {
+            return bep;
+        }
+    }
+    return NULL;
+}
+
+// read back one backend - backends and uris no longer configured are read
+// past and dropped
+static void
+restoreBackend(struct settings *settings, struct state_reader *r)
+{
+    backend_t            *bep;
+    struct uri_entry     *uri_entry;
+    char                 *key;
+    char                 *uri;
+    char                 *name;
+    char                 *valueStr;
+    uint64_t             generation;
+    uint64_t             uriGeneration;
+    uint64_t             published_ms;
+    uint64_t             newest = 0;
+    uint64_t             lastpoll;
+    uint64_t             value;
+    uint64_t             type;
+    uint64_t             nuris;
+    uint64_t             nstats;
+    uint64_t             i;
+    uint64_t             j;
+
+    key = state_get_str(r);
+    bep = (key != NULL) ? findBackend(settings, key) : NULL;
+    free(key);
+    generation = state_get_u64(r);
+    nuris = state_get_u64(r);
+    for (i = 0; i < nuris && !r->err; i++) {
+        uri = state_get_str(r);
+        uri_entry = NULL;
+        if (bep != NULL && uri != NULL) {
+            TAILQ_FOREACH(uri_entry, &bep->uris, next) {
+                if (strcmp(uri_entry->uri, uri) == 0) {
+                    break;
+                }
+            }
+        }
+        free(uri);
+        uriGeneration = state_get_u64(r);
+        published_ms = state_get_u64(r);
+        if (published_ms > newest) {
+            newest = published_ms;
+        }
+        lastpoll = state_get_u64(r);
+        nstats = state_get_u64(r);
+        for (j = 0; j < nstats && !r->err; j++) {
+            name = state_get_str(r);
+            type = state_get_u64(r);
+            value = 0;
+            valueStr = NULL;
+            if (type == UINT64) {
+                value = state_get_u64(r);
+            } else {
+                valueStr = state_get_str(r);
+            }
+            if (uri_entry != NULL && !r->err) {
+                stats_add(&bep->builder, name, (enum stats_type) type,
+                          valueStr, value);
+            }
+            free(name);
+            free(valueStr);
+        }
+        if (uri_entry != NULL && !r->err) {
+            restoreStats(uri_entry, &bep->builder, uriGeneration,
+                         published_ms);
+            uri_entry->lastpoll = lastpoll;
+        }
+        if (bep != NULL) {
+            stats_discard(&bep->builder);
+        }
+    }
+
+    history_load(bep != NULL ? bep->history : NULL, r);
+
+    if (bep != NULL && !r->err) {
+        bep->generation = generation;
+        bep->warm = TRUE;
+        bep->state = POLLING;
+        top_update(bep, newest);
+    }
+}
+
+void
+state_restore(struct settings *settings)
+{
+    struct state_reader r;
+    uint64_t            count;
+    uint64_t            i;
+    int                 best;
+
+    statePath = settings->sys.state_file;
+    if (mapState(statePath, STATE_MIN_CAPACITY, FALSE) != 0) {
+        return;
+    }
+    best = newestRegion();
+    if (best < 0) {
+        return;
+    }
+    r.p = region(best);
+    r.end = r.p + header()->desc[best].len;
+    r.err = FALSE;
+    count = state_get_u64(&r);
+    for (i = 0; i < count && !r.err; i++) {
+        restoreBackend(settings, &r);
+    }
+    if (r.err) {
+        proxylog(LOG_ERR, "state file %s is cut short", statePath);
+    } else {
+        proxylog(LOG_INFO, "restored %"PRIu64" backends from %s", count,
+                 statePath);
+    }
+}
+
+void
+state_save(struct settings *settings, bool_t history)
+{
+    backend_t *bep;
+    FILE      *fp;
+    char      *data = NULL;
+    size_t    len = 0;
+    uint64_t  count = 0;
+    uint64_t  seq;
+    uint64_t  capacity;
+    int       i;
+    char      tmp[MAXPATHLEN];
+
+    if (history) {
+        TAILQ_FOREACH(bep, &settings->proxies, next) {
+            history_checkpoint(bep->history);
+        }
+        TAILQ_FOREACH(bep, &settings->clusters, next) {
+            history_checkpoint(bep->history);
+        }
+    }
+
+    fp = open_memstream(&data, &len);
+    alloc_fail_check(fp);
+    TAILQ_FOREACH(bep, &settings->proxies, next) {
+        count++;
+    }
+    TAILQ_FOREACH(bep, &settings->clusters, next) {
+        count++;
+    }
+    state_put_u64(fp, count);
+    TAILQ_FOREACH(bep, &settings->proxies, next) {
+        saveBackend(bep, fp);
+    }
+    TAILQ_FOREACH(bep, &settings->clusters, next) {
+        saveBackend(bep, fp);
+    }
+    fclose(fp);
+
+    pthread_mutex_lock(&stateLock);
+    if (stateMap == NULL) {
+        goto done;
+    }
+    seq = header()->desc[0].seq > header()->desc[1].seq ?
+          header()->desc[0].seq : header()->desc[1].seq;
+    if (len <= header()->capacity) {
+        i = header()->desc[0].seq <= header()->desc[1].seq ? 0 : 1;
+        writeRegion(i, (uint8_t *) data, len, seq + 1);
+        goto done;
+    }
+
+    // out of room - write a bigger file next to it and move it in place
+    capacity = (len * 2 + STATE_HEADER_SIZE - 1) / STATE_HEADER_SIZE *
+               STATE_HEADER_SIZE;
+    snprintf(tmp, sizeof tmp, "%s.tmp", statePath);
+    unmapState();
+    if (mapState(tmp, capacity, TRUE) == 0) {
+        writeRegion(0, (uint8_t *) data, len, seq + 1);
+        if (rename(tmp, statePath) != 0) {
+            proxylog(LOG_ERR, "state file %s: %s", statePath,
+                     strerror(errno));
+        }
+    } else {
+        mapState(statePath, STATE_MIN_CAPACITY, FALSE);
+    }
+
+done:
+    pthread_mutex_unlock(&stateLock);
+    free(data);
+}
+
+static void *
+runState(void *arg)
+{
+    struct settings *settings = (struct settings *) arg;
+    int             saves = 0;
+
+    while (TRUE) {
+        usleep(STATE_SAVE_MS * 1000);
+        saves++;
+        state_save(settings,
+                   saves % (STATE_HISTORY_SAVE_MS / STATE_SAVE_MS) == 0);
+    }
+    return NULL;
+}
+
+void
+state_start(struct settings *settings)
+{
+    pthread_t      tid;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, runState, settings) != 0) {
+        proxylog(LOG_ERR, "can't start the state saver: %s", strerror(errno));
+    }
+    pthread_attr_destroy(&attr);
+}
@@ -0,0 +1,95 @@
+// ========================================================================
+//
+//  Project   : statsproxy 
+//
+//  Version   : 1.0
+//
+//  Copyright :
+//
+//      Software License Agreement (BSD License)
+//
+//      Copyright (c) 2009, Gear Six, Inc.
+//      All rights reserved.
+//
+//      Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are
+//      met:
+//
+//      * Redistributions of source code must retain the above copyright
+//        notice, this list of conditions and the following disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following disclaimer
+//        in the documentation and/or other materials provided with the
+//        distribution.
+//
+//      * Neither the name of Gear Six, Inc. nor the names of its
+//        contributors may be used to endorse or promote products derived from
+//        this software without specific prior written permission.The Gear Six logo, 
+//        which is provided in the source code and appears on the user interface 
+//        to identify Gear Six, Inc. as the originator of the software program, is 
+//        a trademark of Gear Six, Inc. and can be used only in unaltered form and 
+//        only for purposes of such identification.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// ========================================================================
+//
+
+#ifndef _STATE_H
+#define _STATE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// how often the state is saved, and how often the histories in it are
+// brought up to date - they're far bigger than the snapshots
+#define STATE_SAVE_MS 10000
+#define STATE_HISTORY_SAVE_MS 300000
+
+// the state file holds the latest snapshot and history of every backend,
+// written to alternate regions of a memory-mapped file, so a crash while
+// saving leaves the previous save intact
+
+// map the state file (creating it) and put back what it holds into the
+// configured backends; called before any poller starts
+void state_restore(struct settings *settings);
+
+// save the state now, with the histories as last serialized, or brought
+// up to date first when history is set
+void state_save(struct settings *settings, bool_t history);
+
+// save the state every STATE_SAVE_MS, the histories every
+// STATE_HISTORY_SAVE_MS
+void state_start(struct settings *settings);
+
+// serializing helpers - values are written in the host's byte order, the
+// file is only read back on the same host
+struct state_reader {
+    const uint8_t              *p;             // next byte
+    const uint8_t              *end;           // end of the data
+    int                        err;            // ran past the end
+};
+
+void state_put_u64(FILE *fp, uint64_t v);
+void state_put_str(FILE *fp, const char *str);
+void state_put_bytes(FILE *fp, const void *data, size_t len);
+uint64_t state_get_u64(struct state_reader *r);
+char *state_get_str(struct state_reader *r);
+void state_get_bytes(struct state_reader *r, void *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _STATE_H */
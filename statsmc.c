@@ -328,7 +328,7 @@ sp_memcache_read(backend_t *bep, char *data, int len,
 static int
 sp_memcache_stats_parse_basic(char *str, char **name, char **value)
 {
-    /* "STAT <stat_name> <stat_value>"
+    /* "STAT <stat_name> <stat_value>" - split in place
      */
     int err = 0;
 
@@ -343,12 +343,9 @@ sp_memcache_stats_parse_basic(char *str, char **name, char **value)
 
         tok = strtok_r(str, " ", &save);
         if (tok) {
-            *name = strdup(tok);
-            tok = strtok_r(NULL, " ", &save);
-            if (tok) {
-                *value = strdup(tok);
-            } else {
-                free(*name);
+            *name = tok;
+            *value = strtok_r(NULL, " ", &save);
+            if (*value == NULL) {
                 *name = NULL; // don't return half a result
             }
         }
@@ -358,7 +355,7 @@ sp_memcache_stats_parse_basic(char *str, char **name, char **value)
 
 /* ------------------------------------------------------------------------ */
 static int
-sp_memcache_stats_add_stats(struct stats_entries *stats, 
+sp_memcache_stats_add_stats(struct stats_builder *b, 
                             char *stats_input, int *num_stats_added) 
 {
     /* input string should be formatted as a series of 
@@ -387,11 +384,9 @@ sp_memcache_stats_add_stats(struct stats_entries *stats,
         err = sp_memcache_stats_parse_basic(raw_stat, &stat_name, &stat_val);
         bail_error(err);
         if (stat_name && stat_val) {
-            /* add the stat data to the uri
+            /* add the stat data to the uri - straight from the reply
              */
-            struct stats_entry *entry;
-            entry = newStatEntry(stat_name, ALPHA, stat_val, 0);
-            TAILQ_INSERT_TAIL(stats, entry, next);
+            stats_add(b, stat_name, ALPHA, stat_val, 0);
             (*num_stats_added)++;
         }
         res = strtok_r(NULL, "\r\n", &save);
@@ -400,44 +395,85 @@ sp_memcache_stats_add_stats(struct stats_entries *stats,
     return err;
 }
 
-// parse data received from the server
+uint64_t
+fnv1a(const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) data;
+    uint64_t      hash = 14695981039346656037ULL;
+    size_t        i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// parse data received from the server. The whole reply is read into the
+// backend's reply buffer (one nul terminated chunk per read) and hashed
+// first, so a reply that's byte for byte the last one costs no parsing.
 int
-sp_memcache_read_replies(backend_t *bep, struct stats_entries *stats)
+sp_memcache_read_replies(backend_t *bep, struct stats_builder *b,
+                         uint64_t *fingerprint, bool_t *unchanged)
 {
     int err = 0;
-    char buffer[MAXSTATSZ];
     int done = FALSE;
     int valid_stats_cnt = 0;
+    bool_t canceled = FALSE;
+    size_t used = 0;
+    size_t off;
+    uint64_t hash;
+    char *chunk;
     struct sp_memcache_socket_state session_info;
 
     memset(&session_info, 0, sizeof session_info);
     gettimeofday(&session_info.start_time, NULL);
     session_info.timeout = session_info.time_remaining = bep->settings.read_ms;
+    *unchanged = FALSE;
 
     while(!done) {
-        memset(buffer, 0, MAXSTATSZ);
-        err = sp_memcache_read(bep, buffer, MAXSTATSZ,
+        if (bep->reply_size - used < MAXSTATSZ + 1) {
+            bep->reply_size = used + MAXSTATSZ + 1;
+            bep->reply = (char *) realloc(bep->reply, bep->reply_size);
+            alloc_fail_check(bep->reply);
+        }
+        chunk = bep->reply + used;
+        memset(chunk, 0, MAXSTATSZ + 1);
+        err = sp_memcache_read(bep, chunk, MAXSTATSZ,
                                      &session_info, &done);
         
         /* handle ECANCELED here! 
          */
         if (err == ECANCELED) {
             err = 0;
-            goto bail;
+            canceled = TRUE;
+            break;
         } else {
             bail_error(err);
         }
+        used += session_info.bytes_rcvd + 1;
 
-        err = sp_memcache_stats_add_stats(stats, buffer, &valid_stats_cnt);
-        bail_error(err);
-
-        /* if we complete a socket read and get no valid stats data out of
-         * the buffer then we are obviously being fed crap data, so give up
+        /* if we complete a socket read and get no "<name> <value>" pair
+         * out of the buffer then we are obviously being fed crap data, so
+         * give up
          */
-        if (valid_stats_cnt == 0) {
+        if (memchr(chunk, ' ', session_info.bytes_rcvd) == NULL) {
             done = TRUE;
         }
     }
+
+    hash = fnv1a(bep->reply, used);
+    if (!canceled && *fingerprint != 0 && hash == *fingerprint) {
+        *unchanged = TRUE;
+        goto bail;
+    }
+    *fingerprint = canceled ? 0 : hash;
+
+    for (off = 0; off < used; off += strlen(bep->reply + off) + 1) {
+        err = sp_memcache_stats_add_stats(b, bep->reply + off,
+                                          &valid_stats_cnt);
+        bail_error(err);
+    }
  bail:
     bep->last_error = err;
     return err;
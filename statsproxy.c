@@ -61,6 +61,8 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <poll.h>
+#include <fnmatch.h>
 #include <time.h>
 
 #include "queue.h"
@@ -68,6 +70,15 @@
 #include "proxylog.h"
 #include "mcr_web.h"
 #include "uristrings.h"
+#include "lanes.h"
+#include "ratelimit.h"
+#include "chunked.h"
+#include "cluster.h"
+#include "top.h"
+#include "sketch.h"
+#include "history.h"
+#include "state.h"
+#include "analysis.h"
 
 static char sysLogo[] =
 #include "g6logo.inc"
@@ -83,6 +94,16 @@ timestamp(void)
     return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+// return a monotonic microsecond timestamp for measuring latencies
+static uint64_t
+monotonic_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 // single threaded!
 char *
 addr2host(const struct sockaddr_in *addr)
@@ -148,6 +169,32 @@ write_page_refresh(int refresh_ms, FILE *fp)
 "<BODY onload=\"doLoad()\"> \r\n", refresh_ms);
 }
 
+// live stats pages follow the uri's event stream and update the values in
+// place; browsers without EventSource fall back to reloading the page.
+// Full pages reload when a stat shows up that they don't have yet.
+static void
+write_page_events(const char *uri, int refresh_ms, bool_t all, FILE *fp)
+{
+    fprintf(fp,
+"<script language=\"JavaScript\"> "
+"function doLoad() { "
+"if (!window.EventSource || !window.JSON) { "
+"setTimeout(\"window.location.reload(false)\", %d); return; } "
+"var es = new EventSource(\"/%s%sevents\"); "
+"es.addEventListener(\"stats\", function(e) { "
+"var d = JSON.parse(e.data); var n, el; "
+"for (n in d.stats) { "
+"el = document.getElementById(\"stat-\" + n); "
+"if (!el) { if (%d) { es.close(); window.location.reload(false); return; } "
+"continue; } "
+"el.textContent = d.stats[n]; } "
+"el = document.getElementById(\"sp-time\"); "
+"if (el) { el.textContent = new Date().toString(); } "
+"}, false); } "
+"</script>\r\n"
+"<BODY onload=\"doLoad()\"> \r\n", refresh_ms, uri, uri[0] ? "/" : "", all);
+}
+
 static char *
 rfc1123date(char *datestr, time_t t)
 {
@@ -157,29 +204,81 @@ rfc1123date(char *datestr, time_t t)
   return datestr;
 }
 
+// start an http response.  HTTP/1.1 clients get the body chunked - from
+// here on clnt->fp is the chunk writer, so bodies of any size stream out
+// in bounded memory and the connection can be reused; older clients get
+// the body up to the connection close.
 static void
-write_http_header(const char *mimeType, FILE *http) 
+write_http_status(proxyclient_t *clnt, int httpCode, const char *reason,
+                  const char *mimeType)
 {
     char dateBuf[DATEBUFSZ], lastModifiedBuf[DATEBUFSZ];
     time_t now;
 
     time(&now);
-    fprintf(http,
-        "HTTP/1.1 200 OK\r\n"
+    fprintf(clnt->fp,
+        "HTTP/%d.%d %d %s\r\n"
         "X-Date: %s\r\n"
         "Server: Gear6 Memcached\r\n"
         "MIME-version: 1.0\r\n"
         "Last-Modified: %s\r\n"
         "Cache-Control: no-cache\r\n"
-        "Content-type: %s\r\n\r\n",
+        "Content-type: %s\r\n",
+        HTTP_MAJOR, HTTP_MINOR, httpCode, reason,
         rfc1123date(dateBuf, now), rfc1123date(lastModifiedBuf, now), mimeType);
+    if (clnt->http11) {
+        fprintf(clnt->fp, "Transfer-Encoding: chunked\r\n%s\r\n",
+                clnt->keepAlive ? "" : "Connection: close\r\n");
+        clnt->sock = clnt->fp;
+        clnt->fp = chunked_open(clnt->sock);
+        clnt->framed = TRUE;
+    } else {
+        fprintf(clnt->fp, "Connection: close\r\n\r\n");
+        clnt->keepAlive = FALSE;
+    }
+}
+
+static void
+write_http_header(proxyclient_t *clnt, const char *mimeType)
+{
+    write_http_status(clnt, HTTP_OK, "OK", mimeType);
+}
+
+// finish the response body - writes the last chunk of a chunked body
+static void
+end_http_response(proxyclient_t *clnt)
+{
+    if (clnt->sock != NULL) {
+        fclose(clnt->fp);
+        clnt->fp = clnt->sock;
+        clnt->sock = NULL;
+    }
 }
 
+// a complete response with a small fixed body (errors, redirects)
 static void
-write_html_image(FILE *http, char *bits, int size)
+write_http_short(proxyclient_t *clnt, int httpCode, const char *reason,
+                 const char *extraHeaders, const char *body)
 {
-    write_http_header("image/png", http);
-    fwrite(bits, size, 1, http);
+    fprintf(clnt->fp,
+        "HTTP/%d.%d %d %s\r\n"
+        "Server: Gear6 Memcached\r\n"
+        "%s"
+        "Content-type: text/html\r\n"
+        "Content-Length: %d\r\n"
+        "%s\r\n"
+        "%s",
+        HTTP_MAJOR, HTTP_MINOR, httpCode, reason, extraHeaders,
+        (int) strlen(body), clnt->keepAlive ? "" : "Connection: close\r\n",
+        body);
+    clnt->framed = TRUE;
+}
+
+static void
+write_html_image(proxyclient_t *clnt, char *bits, int size)
+{
+    write_http_header(clnt, "image/png");
+    fwrite(bits, size, 1, clnt->fp);
 }
 static void
 write_html_body(FILE *http)
@@ -208,14 +307,26 @@ write_html_service_info(proxyclient_t *clnt, int vipLabel)
     timeBuf[strlen(timeBuf) - 1] = '\0'; // zap newline
     addr.s_addr = bep->settings.backaddr;
 
-    if (vipLabel) {
+    if (vipLabel && bep->cluster != NULL) {
+        fprintf(clnt->fp,
+            "<img border=\"0\" src=\"logo.png\" alt=\"Logo\" "
+            "align=\"absmiddle\"/>"
+            "&nbsp;&nbsp;Cluster Information for pool "
+            "<b>%s</b> "
+            "<font size=\"-1\">(proxy %s:%d)</font> "
+            "<span id=\"sp-time\">%s</span><br>",
+            bep->settings.pool != NULL ? bep->settings.pool : "(all)",
+            bep->settings.fronthost,
+            bep->settings.frontport,
+            timeBuf);
+    } else if (vipLabel) {
         fprintf(clnt->fp, "<a href=\"http://%s\">"
             "<img border=\"0\" src=\"logo.png\" alt=\"Logo\" "
             "align=\"absmiddle\"/></a>"
             "&nbsp;&nbsp;Memcache Information for "
             "<b>%s:%d</b> "
             "<font size=\"-1\">(proxy %s:%d)</font> "
-            "%s<br>",
+            "<span id=\"sp-time\">%s</span><br>",
             bep->settings.backhost,
             bep->settings.backhost,
             bep->settings.backport,
@@ -348,6 +459,7 @@ runFrontend(void *arg)
         alloc_fail_check(clnt);
         clnt->fd = newsockfd;
         clnt->bep = bep;
+        clnt->addr = cli_addr;
         if (pthread_create(&chld_thr, NULL, handleFrontendRequest,
                            (void *) clnt) != 0) {
             proxylog(LOG_ERR, "could not create thread for %s:%d: %s",
@@ -361,6 +473,49 @@ runFrontend(void *arg)
     return NULL;
 }
 
+// find a backend stats uri
+static struct uri_entry *
+findUriEntry(backend_t *bep, const char *uri)
+{
+    struct uri_entry *entry;
+
+    TAILQ_FOREACH(entry, &bep->uris, next) {
+        if (strcmp(entry->uri, uri) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// find the stats uri behind an event stream uri ("<uri>/events", or just
+// "events" for the basic stats)
+static struct uri_entry *
+findEventsUri(backend_t *bep, const char *uri)
+{
+    char   base[MAXREQSZ];
+    size_t len = strlen(uri);
+    size_t suffix = strlen(EVENTS_URI);
+
+    if (len < suffix || strcmp(uri + len - suffix, EVENTS_URI) != 0) {
+        return NULL;
+    }
+    len -= suffix;
+    if (len > 0) {
+        if (uri[len - 1] != '/') {
+            return NULL;
+        }
+        len--;
+    }
+    memcpy(base, uri, len);
+    base[len] = '\0';
+    return findUriEntry(bep, base);
+}
+
+static int eventsCallback(void *arg, char *uri);
+static int watchCallback(void *arg, char *uri);
+static int getCallback(void *arg, char *uri);
+static int fleetCallback(void *arg, char *uri);
+
 static callback_t
 findCallback(proxyclient_t *clnt, char *uri)
 {
@@ -381,13 +536,32 @@ findCallback(proxyclient_t *clnt, char *uri)
             return bep_entry->cb;
         }
     }
+
+    // live update streams for the stats uris
+    if (clnt->type == HTTP_CLIENT && findEventsUri(clnt->bep, uri) != NULL) {
+        return eventsCallback;
+    }
+
+    // one uri across the fleet
+    if (clnt->type == HTTP_CLIENT &&
+        strncmp(uri, FLEET_URI "/", strlen(FLEET_URI "/")) == 0) {
+        return fleetCallback;
+    }
     return NULL;
 }
 
+// memcache "get"/"gets" of single stats
+static bool_t
+isGet(const char *method)
+{
+    return strcmp(method, "get") == 0 || strcmp(method, "gets") == 0;
+}
+
 static void
 setClientType(proxyclient_t *clnt, char *method)
 {
-    if (strcmp(method, "stats") == 0) {
+    if (strcmp(method, "stats") == 0 || strcmp(method, "watch") == 0 ||
+        isGet(method)) {
         clnt->type = MEMCACHE_CLIENT;
     } else {
         clnt->type = HTTP_CLIENT;
@@ -410,21 +584,31 @@ badMethod(char *method)
     if (strcmp(method, "stats") == 0) {
         return FALSE;
     }
+    if (strcmp(method, "watch") == 0) {
+        return FALSE;
+    }
+    if (isGet(method)) {
+        return FALSE;
+    }
     return TRUE;
 }
 
 static void
 clntRedirect(proxyclient_t *clnt, int httpCode, const char *uri)
 {
+    char location[MAXREQSZ + 16];
+
     switch (httpCode) {
     case HTTP_MOVEPERM:
     case HTTP_MOVETEMP:
-        fprintf(clnt->fp, "HTTP/%d.%d %d %s\r\nLocation: %s\r\n",
-            HTTP_MAJOR, HTTP_MINOR, httpCode, "Found", uri);
+        snprintf(location, sizeof location, "Location: %s\r\n", uri);
+        write_http_short(clnt, httpCode,
+                         httpCode == HTTP_MOVEPERM ? "Moved Permanently" :
+                                                     "Found",
+                         location, "");
         break;
     default:
-        fprintf(clnt->fp, "HTTP/%d.%d %d %s\r\n",
-            HTTP_MAJOR, HTTP_MINOR, httpCode, "ERROR");
+        write_http_short(clnt, httpCode, "ERROR", "", "");
     }
 }
 
@@ -443,11 +627,15 @@ clntError(proxyclient_t *clnt, int httpCode, char *uri)
         return;
     }
     switch (httpCode) {
-    case HTTP_NOTFOUND:
-        fprintf(clnt->fp, ERR_404, uri);
+    case HTTP_NOTFOUND: {
+        char body[MAXREQSZ + sizeof ERR_404];
+
+        snprintf(body, sizeof body, ERR_404, uri);
+        write_http_short(clnt, httpCode, "Not Found", "", body);
         break;
+    }
     case HTTP_SERVUNAVAIL:
-        write_http_header("text/html", clnt->fp);
+        write_http_status(clnt, httpCode, "Service Unavailable", "text/html");
         write_html_body(clnt->fp);
         write_page_refresh(clnt->bep->settings.refreshfreq_ms, clnt->fp);
         write_html_service_info(clnt, TRUE);
@@ -455,106 +643,1667 @@ clntError(proxyclient_t *clnt, int httpCode, char *uri)
                 "Error getting stats from remote memcached: <b>%s</b>",
                 strerror(clnt->bep->last_error));
         end_html_body(clnt->fp);
+        end_http_response(clnt);
+        break;
+    case HTTP_BADREQUEST:
+        write_http_short(clnt, httpCode, "Bad Request", "", "");
         break;
     default:
-        fprintf(clnt->fp, "HTTP/%d.%d %d %s\r\n",
-        HTTP_MAJOR, HTTP_MINOR, httpCode, "ERROR");
+        write_http_short(clnt, httpCode, "ERROR", "", "");
+    }
+}
+
+// lane stayed full - cheap rejection, no rendering
+static void
+clntBusy(proxyclient_t *clnt)
+{
+    if (clnt->type == MEMCACHE_CLIENT) {
+        fprintf(clnt->fp, "SERVER_ERROR busy\r\n");
+        return;
+    }
+    clnt->keepAlive = FALSE;
+    write_http_short(clnt, HTTP_SERVUNAVAIL, "Service Unavailable",
+                     "Retry-After: 1\r\n", "");
+}
+
+// client is over its lane's rate - cheap rejection, no rendering
+static void
+clntLimited(proxyclient_t *clnt)
+{
+    if (clnt->type == MEMCACHE_CLIENT) {
+        fprintf(clnt->fp, "SERVER_ERROR rate limited\r\n");
+        return;
+    }
+    write_http_short(clnt, HTTP_TOOMANY, "Too Many Requests",
+                     "Retry-After: 1\r\n", "");
+}
+
+// add a name or pattern to a request filter - a trailing '*' is taken as
+// a plain prefix, other wildcards make it a glob
+static void
+addStatFilter(stat_filter_t *filter, char *name, enum stat_match match)
+{
+    size_t len = strlen(name);
+
+    if (filter->count >= MAXSTATARGS || len == 0) {
+        return;
     }
+    if (match == MATCH_NAME && strpbrk(name, "*?[") != NULL) {
+        if (strpbrk(name, "*?[") == name + len - 1 && name[len - 1] == '*') {
+            name[len - 1] = '\0';
+            match = MATCH_PREFIX;
+        } else {
+            match = MATCH_GLOB;
+        }
+    }
+    filter->names[filter->count] = name;
+    filter->match[filter->count] = match;
+    filter->count++;
 }
 
+// first index slot whose name is >= the first len chars of key
 static int
-countStat(struct uri_entry *uri_entry, const char *name)
+lowerBound(struct uri_entry *uri_entry, const char *key, size_t len)
+{
+    struct stats_entry **index = uri_entry->stats->index;
+    int                lo = 0;
+    int                hi = uri_entry->stats->count;
+    int                mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (strncmp(index[mid]->name, key, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// look up one stat by name
+static struct stats_entry *
+findStat(struct uri_entry *uri_entry, const char *name)
+{
+    struct stats_snapshot *snap = uri_entry->stats;
+    int                   slot = schema_find(name);
+
+    // known stats of the general stats are a slot away
+    if (slot >= 0 && GENERAL_URI(uri_entry)) {
+        return snap->known[slot];
+    }
+    slot = lowerBound(uri_entry, name, strlen(name) + 1);
+    if (slot < snap->count && strcmp(snap->index[slot]->name, name) == 0) {
+        return snap->index[slot];
+    }
+    return NULL;
+}
+
+typedef void (*stat_visit_t)(struct stats_entry *entry, void *arg);
+
+// call visit for each stat the filter asks for (all of them, in reply
+// order, when there's no filter). Names and prefixes are looked up in the
+// name index, globs only walk the index range of their literal prefix.
+static void
+visitStats(struct uri_entry *uri_entry, stat_filter_t *filter,
+           stat_visit_t visit, void *arg)
+{
+    struct stats_snapshot *snap = uri_entry->stats;
+    struct stats_entry    *entry;
+    const char            *pattern;
+    size_t                len;
+    int                   i;
+    int                   slot;
+
+    if (filter == NULL || filter->count == 0) {
+        for (i = 0; i < snap->count; i++) {
+            visit(&snap->entries[i], arg);
+        }
+        return;
+    }
+    for (i = 0; i < filter->count; i++) {
+        pattern = filter->names[i];
+        switch (filter->match[i]) {
+        case MATCH_NAME:
+            len = strlen(pattern) + 1;
+            break;
+        case MATCH_PREFIX:
+            len = strlen(pattern);
+            break;
+        default:
+            len = strcspn(pattern, "*?[\\");
+        }
+        for (slot = lowerBound(uri_entry, pattern, len);
+             slot < snap->count &&
+             strncmp(snap->index[slot]->name, pattern, len) == 0;
+             slot++) {
+            entry = snap->index[slot];
+            if (filter->match[i] != MATCH_GLOB ||
+                fnmatch(pattern, entry->name, 0) == 0) {
+                visit(entry, arg);
+            }
+        }
+    }
+}
+
+// does the filter ask for this stat
+static bool_t
+statMatches(stat_filter_t *filter, const char *name)
+{
+    int i;
+
+    if (filter == NULL || filter->count == 0) {
+        return TRUE;
+    }
+    for (i = 0; i < filter->count; i++) {
+        switch (filter->match[i]) {
+        case MATCH_NAME:
+            if (strcmp(name, filter->names[i]) == 0) {
+                return TRUE;
+            }
+            break;
+        case MATCH_PREFIX:
+            if (strncmp(name, filter->names[i],
+                        strlen(filter->names[i])) == 0) {
+                return TRUE;
+            }
+            break;
+        default:
+            if (fnmatch(filter->names[i], name, 0) == 0) {
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+// call visit for each stat the filter asks for that changed after
+// generation 'since', in reply order. The change maps of the publishes
+// since then are or'ed a word at a time and only their set bits visited.
+// When the changes that far back aren't known any more every stat asked
+// for is visited instead.
+static void
+visitChanges(struct uri_entry *uri_entry, stat_filter_t *filter,
+             uint64_t since, stat_visit_t visit, void *arg)
+{
+    struct change_map *map;
+    uint64_t          word;
+    int               words = (uri_entry->stats->count + 63) / 64;
+    int               w;
+    int               i;
+
+    if (since < uri_entry->changedFrom) {
+        visitStats(uri_entry, filter, visit, arg);
+        return;
+    }
+    for (w = 0; w < words; w++) {
+        word = 0;
+        for (i = 0; i < CHANGE_HISTORY; i++) {
+            map = &uri_entry->changes[i];
+            if (map->bits != NULL && map->generation > since) {
+                word |= map->bits[w];
+            }
+        }
+        while (word != 0) {
+            struct stats_entry *entry =
+                &uri_entry->stats->entries[w * 64 + __builtin_ctzll(word)];
+
+            if (statMatches(filter, entry->name)) {
+                visit(entry, arg);
+            }
+            word &= word - 1;
+        }
+    }
+}
+
+static void
+rawPrintStat(struct stats_entry *entry, void *arg)
+{
+    FILE *fp = (FILE *) arg;
+
+    if (entry->type == ALPHA) {
+        fprintf(fp, "STAT %s %s\r\n", entry->name, entry->v.valueStr);
+    } else {
+        fprintf(fp, "STAT %s %"PRIu64"\r\n", entry->name, entry->v.value);
+    }
+}
+
+static void
+rawPrintStats(char *uri, struct uri_entry *uri_entry, stat_filter_t *filter,
+              FILE *fp)
+{
+    visitStats(uri_entry, filter, rawPrintStat, fp);
+    fprintf(fp, "END\r\n");
+}
+
+static void
+htmlPrintStat(struct stats_entry *entry, void *arg)
+{
+    FILE *fp = (FILE *) arg;
+
+    if (entry->type == ALPHA) {
+        fprintf(fp,
+                "<font size=\"-2\">STAT</font> <i>%s</i> "
+                "<b id=\"stat-%s\">%s</b><br>",
+                entry->name, entry->name, entry->v.valueStr);
+    } else {
+        fprintf(fp,
+                "<font size=\"-2\">STAT</font> <i>%s</i> "
+                "<b id=\"stat-%s\">%"PRIu64"</b><br>",
+                entry->name, entry->name, entry->v.value);
+    }
+}
+
+// slab fields whose sum over the classes means nothing
+static const char *slabNoTotal[] = {
+    "chunk_size", "chunks_per_page", "age", "evicted_time", NULL
+};
+
+// the slab matrix as a table - a row per slab class, a column per field
+// and a row of totals. Cells keep their stat ids for the event stream.
+static void
+htmlPrintSlabs(struct slab_matrix *m, FILE *fp)
+{
+    const char **skip;
+    int        cell;
+    int        f;
+    int        r;
+
+    fprintf(fp, "<table><tr><th>slab</th>");
+    for (f = 0; f < m->nfields; f++) {
+        fprintf(fp, "<th>%s</th>", m->field[f]);
+    }
+    fprintf(fp, "</tr>");
+    for (r = 0; r < m->nslabs; r++) {
+        fprintf(fp, "<tr><td>%d</td>", m->slab[r]);
+        for (f = 0; f < m->nfields; f++) {
+            cell = f * m->nslabs + r;
+            if (m->have[cell]) {
+                fprintf(fp, "<td align=\"right\" id=\"stat-%s%d:%s\">%"PRIu64
+                        "</td>", m->prefix, m->slab[r], m->field[f],
+                        m->vals[cell]);
+            } else {
+                fprintf(fp, "<td></td>");
+            }
+        }
+        fprintf(fp, "</tr>");
+    }
+    fprintf(fp, "<tr><td><b>total</b></td>");
+    for (f = 0; f < m->nfields; f++) {
+        for (skip = slabNoTotal; *skip != NULL; skip++) {
+            if (strcmp(*skip, m->field[f]) == 0) {
+                break;
+            }
+        }
+        if (*skip != NULL) {
+            fprintf(fp, "<td></td>");
+        } else {
+            fprintf(fp, "<td align=\"right\"><b>%"PRIu64"</b></td>",
+                    slab_total(m, f));
+        }
+    }
+    fprintf(fp, "</tr></table>");
+}
+
+// per slab stats are shown as a table when the whole uri is asked for
+static void
+htmlPrintStats(char *uri, struct uri_entry *uri_entry, stat_filter_t *filter,
+               FILE *fp)
+{
+    struct stats_snapshot *snap = uri_entry->stats;
+    int                   i;
+
+    if (snap->slabs == NULL || (filter != NULL && filter->count > 0)) {
+        visitStats(uri_entry, filter, htmlPrintStat, fp);
+        return;
+    }
+    for (i = 0; i < snap->count; i++) {
+        if (snap->entries[i].slab < 0) {
+            htmlPrintStat(&snap->entries[i], fp);
+        }
+    }
+    htmlPrintSlabs(snap->slabs, fp);
+}
+
+// pull the stat filter off web request params ("stat=a&stat=b&prefix=c")
+static void
+parseStatParams(stat_filter_t *filter, const char *params)
+{
+    char *tok;
+    char *save;
+
+    filter->count = 0;
+    filter->hasSince = FALSE;
+    snprintf(filter->buf, sizeof filter->buf, "%s", params);
+    for (tok = strtok_r(filter->buf, "&", &save); tok != NULL;
+         tok = strtok_r(NULL, "&", &save)) {
+        if (strncmp(tok, "stat=", 5) == 0) {
+            addStatFilter(filter, tok + 5, MATCH_NAME);
+        } else if (strncmp(tok, "prefix=", 7) == 0) {
+            addStatFilter(filter, tok + 7, MATCH_PREFIX);
+        } else if (strncmp(tok, "since=", 6) == 0) {
+            filter->since = strtoull(tok + 6, NULL, 10);
+            filter->hasSince = TRUE;
+        }
+    }
+}
+
+// write a string into a page, escaping markup - for anything taken from
+// a request
+static void
+write_html_string(const char *str, FILE *fp)
+{
+    const char *c;
+
+    for (c = str; *c != '\0'; c++) {
+        switch (*c) {
+        case '<':
+            fputs("&lt;", fp);
+            break;
+        case '>':
+            fputs("&gt;", fp);
+            break;
+        case '&':
+            fputs("&amp;", fp);
+            break;
+        case '"':
+            fputs("&quot;", fp);
+            break;
+        case '\'':
+            fputs("&#39;", fp);
+            break;
+        default:
+            fputc(*c, fp);
+        }
+    }
+}
+
+// write a quoted json string
+static void
+write_json_string(const char *str, FILE *fp)
+{
+    const char *c;
+
+    fputc('"', fp);
+    for (c = str; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', fp);
+            fputc(*c, fp);
+        } else if ((unsigned char) *c < 0x20) {
+            fprintf(fp, "\\u%04x", (unsigned char) *c);
+        } else {
+            fputc(*c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+// write a stat value - plain counters as json numbers, the rest as strings
+static void
+write_json_value(const char *str, FILE *fp)
+{
+    size_t len = strspn(str, "0123456789");
+
+    if (len > 0 && len < 20 && str[len] == '\0') {
+        fputs(str, fp);
+    } else {
+        write_json_string(str, fp);
+    }
+}
+
+struct json_print {
+    FILE       *fp;
+    const char *sep;
+};
+
+static void
+jsonPrintStat(struct stats_entry *entry, void *arg)
+{
+    struct json_print *jp = (struct json_print *) arg;
+
+    fputs(jp->sep, jp->fp);
+    write_json_string(entry->name, jp->fp);
+    fputc(':', jp->fp);
+    if (entry->type == ALPHA) {
+        write_json_value(entry->v.valueStr, jp->fp);
+    } else {
+        fprintf(jp->fp, "%"PRIu64, entry->v.value);
+    }
+    jp->sep = ",";
+}
+
+static void
+jsonPrintStats(struct uri_entry *uri_entry, stat_filter_t *filter, FILE *fp)
+{
+    struct json_print jp;
+
+    jp.fp = fp;
+    jp.sep = "";
+    fputc('{', fp);
+    visitStats(uri_entry, filter, jsonPrintStat, &jp);
+    fputc('}', fp);
+}
+
+// is a plain "name=value" param in the request params
+static bool_t
+hasParam(const char *params, const char *param)
 {
-    struct stats_entry *entry;
-    int count = 0;
+    size_t     len = strlen(param);
+    const char *p;
 
-    TAILQ_FOREACH(entry, &uri_entry->stats, next) {
-        if (strcmp(entry->name, name) == 0) {
-            count++;
+    for (p = params; p != NULL; p = strchr(p, '&')) {
+        if (*p == '&') {
+            p++;
+        }
+        if (strncmp(p, param, len) == 0 && (p[len] == '&' || p[len] == '\0')) {
+            return TRUE;
         }
     }
-    return count;
+    return FALSE;
 }
 
+// the stats changed after the filter's generation, with the uri's
+// generation to ask from next time - 'full' says the changes went back too
+// far and every stat is given
 static void
-rawPrintStats(char *uri, struct uri_entry *uri_entry, FILE *fp)
+deltaPrintStats(struct uri_entry *entry, stat_filter_t *filter, bool_t json,
+                FILE *fp)
 {
-    struct stats_entry *entry;
+    struct json_print jp;
+    bool_t            full = filter->since < entry->changedFrom;
+
+    if (!json) {
+        fprintf(fp, "STAT generation %"PRIu64"\r\n", entry->generation);
+        fprintf(fp, "STAT full %d\r\n", full ? 1 : 0);
+        visitChanges(entry, filter, filter->since, rawPrintStat, fp);
+        fprintf(fp, "END\r\n");
+        return;
+    }
+    fprintf(fp, "{\"generation\":%"PRIu64",\"full\":%s,\"stats\":{",
+            entry->generation, full ? "true" : "false");
+    jp.fp = fp;
+    jp.sep = "";
+    visitChanges(entry, filter, filter->since, jsonPrintStat, &jp);
+    fputs("}}\n", fp);
+}
+
+static const char *wasteSources[] = { "none", "mem_requested", "sizes" };
+static const char *problemNames[] = { "evicting", "fragmented", "underused" };
+#define NUM_PROBLEMS ((int) (sizeof problemNames / sizeof problemNames[0]))
+
+// a slab class's problems, comma separated (quoted for json)
+static void
+writeProblems(int problems, bool_t json, const char *none, FILE *fp)
+{
+    const char *sep = "";
+    const char *quote = json ? "\"" : "";
+    int        i;
+
+    for (i = 0; i < NUM_PROBLEMS; i++) {
+        if (problems & (1 << i)) {
+            fprintf(fp, "%s%s%s%s", sep, quote, problemNames[i], quote);
+            sep = ",";
+        }
+    }
+    if (*sep == '\0') {
+        fputs(none, fp);
+    }
+}
+
+// the slab analysis of the last poll: per slab class fill, fragmentation,
+// eviction and hit rates, and the classes with problems, worst first
+static int
+slabAnalysisCallback(void *arg, char *uri)
+{
+    int                  closeConnection = TRUE;
+    proxyclient_t        *clnt = (proxyclient_t *) arg;
+    backend_t            *bep = clnt->bep;
+    struct slab_analysis *a;
+    struct slab_class    *c;
+    char                 *params;
+    bool_t               json = FALSE;
+    int                  i;
+
+    if ((params = strchr(uri, '?')) != NULL) {
+        *params++ = '\0';
+        json = hasParam(params, "format=json");
+    }
 
-    TAILQ_FOREACH(entry, &uri_entry->stats, next) {
-        if (countStat(uri_entry, entry->name) > 1) {
-            proxylog(LOG_ERR, "dupe stat %s detected", entry->name);
+    // copy it out so a slow client doesn't hold the backend
+    a = (struct slab_analysis *) malloc(sizeof *a);
+    alloc_fail_check(a);
+    rdlock(bep);
+    if (bep->analysis == NULL || bep->state != POLLING) {
+        unlock(bep);
+        free(a);
+        clntError(clnt, HTTP_SERVUNAVAIL, uri);
+        return closeConnection;
+    }
+    memcpy(a, bep->analysis, sizeof *a);
+    unlock(bep);
+
+    if (clnt->type == MEMCACHE_CLIENT) {
+        fprintf(clnt->fp, "STAT memory %"PRIu64"\r\n", a->memory);
+        fprintf(clnt->fp, "STAT used %"PRIu64"\r\n", a->used);
+        fprintf(clnt->fp, "STAT wasted %"PRIu64"\r\n", a->wasted);
+        fprintf(clnt->fp, "STAT waste_source %s\r\n", wasteSources[a->source]);
+        for (i = 0; i < a->nclasses; i++) {
+            c = &a->classes[i];
+            fprintf(clnt->fp, "STAT %d:chunk_size %"PRIu64"\r\n"
+                    "STAT %d:pages %"PRIu64"\r\n"
+                    "STAT %d:total_chunks %"PRIu64"\r\n"
+                    "STAT %d:used_chunks %"PRIu64"\r\n"
+                    "STAT %d:items %"PRIu64"\r\n"
+                    "STAT %d:fill %.3f\r\n"
+                    "STAT %d:wasted %"PRIu64"\r\n"
+                    "STAT %d:evictions_per_sec %.3f\r\n"
+                    "STAT %d:hits_per_sec %.3f\r\n"
+                    "STAT %d:problems ", c->slab, c->chunkSize,
+                    c->slab, c->pages, c->slab, c->totalChunks, c->slab,
+                    c->usedChunks, c->slab, c->items, c->slab, c->fill,
+                    c->slab, c->wasted, c->slab, c->evictRate, c->slab,
+                    c->hitRate, c->slab);
+            writeProblems(c->problems, FALSE, "none", clnt->fp);
+            fprintf(clnt->fp, "\r\n");
+        }
+        for (i = 0; i < a->nranked; i++) {
+            fprintf(clnt->fp, "STAT rank:%d %d\r\n", i + 1,
+                    a->classes[a->ranked[i]].slab);
+        }
+        fprintf(clnt->fp, "END\r\n");
+        closeConnection = FALSE;
+    } else if (json) {
+        write_http_header(clnt, "application/json");
+        fprintf(clnt->fp, "{\"backend\":\"%s:%d\",\"time\":%"PRIu64","
+                "\"memory\":%"PRIu64",\"used\":%"PRIu64",\"wasted\":%"PRIu64
+                ",\"waste_source\":\"%s\",\"classes\":[",
+                bep->settings.backhost, bep->settings.backport,
+                a->stamp / NUM_MSECS_PER_SEC, a->memory, a->used, a->wasted,
+                wasteSources[a->source]);
+        for (i = 0; i < a->nclasses; i++) {
+            c = &a->classes[i];
+            fprintf(clnt->fp, "%s{\"slab\":%d,\"chunk_size\":%"PRIu64","
+                    "\"pages\":%"PRIu64",\"total_chunks\":%"PRIu64","
+                    "\"used_chunks\":%"PRIu64",\"items\":%"PRIu64","
+                    "\"fill\":%.3f,\"requested\":%"PRIu64",\"wasted\":%"PRIu64
+                    ",\"evictions_per_sec\":%.3f,\"hits_per_sec\":%.3f,"
+                    "\"problems\":[", i > 0 ? "," : "", c->slab, c->chunkSize,
+                    c->pages, c->totalChunks, c->usedChunks, c->items, c->fill,
+                    c->requested, c->wasted, c->evictRate, c->hitRate);
+            writeProblems(c->problems, TRUE, "", clnt->fp);
+            fprintf(clnt->fp, "]}");
+        }
+        fprintf(clnt->fp, "],\"ranked\":[");
+        for (i = 0; i < a->nranked; i++) {
+            fprintf(clnt->fp, "%s%d", i > 0 ? "," : "",
+                    a->classes[a->ranked[i]].slab);
+        }
+        fprintf(clnt->fp, "]}\n");
+    } else {
+        write_http_header(clnt, "text/html");
+        write_html_body(clnt->fp);
+        write_page_refresh(bep->settings.refreshfreq_ms, clnt->fp);
+        write_html_service_info(clnt, TRUE);
+        fprintf(clnt->fp, "<b>Slab analysis</b><br><table>"
+                "<tr><td>memory</td><td align=\"right\">%"PRIu64"</td></tr>"
+                "<tr><td>used</td><td align=\"right\">%"PRIu64"</td></tr>"
+                "<tr><td>wasted (%s)</td><td align=\"right\">%"PRIu64
+                "</td></tr></table><br><table><tr><th>slab</th>"
+                "<th>chunk_size</th><th>pages</th><th>items</th><th>fill</th>"
+                "<th>wasted</th><th>evictions/s</th><th>hits/s</th>"
+                "<th>problems</th></tr>", a->memory, a->used,
+                wasteSources[a->source], a->wasted);
+        for (i = 0; i < a->nranked + a->nclasses; i++) {
+            // the problem classes first, worst first, then all of them
+            if (i == a->nranked) {
+                fprintf(clnt->fp, "<tr><td colspan=\"9\"><hr></td></tr>");
+            }
+            c = &a->classes[i < a->nranked ? a->ranked[i] : i - a->nranked];
+            fprintf(clnt->fp, "<tr><td>%d</td>"
+                    "<td align=\"right\">%"PRIu64"</td>"
+                    "<td align=\"right\">%"PRIu64"</td>"
+                    "<td align=\"right\">%"PRIu64"</td>"
+                    "<td align=\"right\">%.3f</td>"
+                    "<td align=\"right\">%"PRIu64"</td>"
+                    "<td align=\"right\">%.3f</td>"
+                    "<td align=\"right\">%.3f</td><td>", c->slab,
+                    c->chunkSize, c->pages, c->items, c->fill, c->wasted,
+                    c->evictRate, c->hitRate);
+            writeProblems(c->problems, FALSE, "", clnt->fp);
+            fprintf(clnt->fp, "</td></tr>");
+        }
+        fprintf(clnt->fp, "</table>");
+        end_html_body(clnt->fp);
+    }
+    free(a);
+    return closeConnection;
+}
+
+// deliver cached stats
+static int
+statsCallback(void *arg, char *uri)
+{
+    int              closeConnection = TRUE;
+    proxyclient_t    *clnt = (proxyclient_t *) arg;
+    backend_t        *bep = clnt->bep;
+    struct           uri_entry *entry = NULL;
+    char             *params;
+    bool_t           json = FALSE;
+
+    // web requests carry their stat filter (and format) as params
+    if ((params = strchr(uri, '?')) != NULL) {
+        *params++ = '\0';
+        if (clnt->type == HTTP_CLIENT) {
+            parseStatParams(&clnt->filter, params);
+            json = hasParam(params, "format=json");
+        }
+    }
+
+    // find the uri
+    entry = findUriEntry(bep, uri);
+    if (entry == NULL) {
+        clntError(clnt, HTTP_NOTFOUND, uri);
+        goto bail;
+    }
+    rdlock(clnt->bep);
+
+    if (clnt->bep->state != POLLING) {
+        clntError(clnt, HTTP_SERVUNAVAIL, uri);
+        unlock(clnt->bep);
+        goto bail;
+    }
+
+    // deliver the stays chain hanging off of it
+    if (clnt->type == MEMCACHE_CLIENT) {
+        if (clnt->filter.hasSince) {
+            deltaPrintStats(entry, &clnt->filter, FALSE, clnt->fp);
+        } else {
+            rawPrintStats(uri, entry, &clnt->filter, clnt->fp);
+        }
+        closeConnection = FALSE;
+        unlock(clnt->bep);
+    } else {
+        // render the page in memory so a slow browser doesn't hold the
+        // backend lock (and the scrapers waiting behind the poller)
+        FILE   *sock = clnt->fp;
+        char   *page = NULL;
+        size_t pagelen = 0;
+
+        clnt->fp = open_memstream(&page, &pagelen);
+        alloc_fail_check(clnt->fp);
+        if (clnt->filter.hasSince) {
+            json = TRUE;
+            deltaPrintStats(entry, &clnt->filter, TRUE, clnt->fp);
+        } else if (json) {
+            jsonPrintStats(entry, &clnt->filter, clnt->fp);
+            fputc('\n', clnt->fp);
+        } else {
+            write_html_body(clnt->fp);
+            write_page_events(uri, clnt->bep->settings.refreshfreq_ms,
+                              clnt->filter.count == 0, clnt->fp);
+            write_html_service_info(clnt, TRUE);
+            htmlPrintStats(uri, entry, &clnt->filter, clnt->fp);
+            end_html_body(clnt->fp);
+        }
+        fclose(clnt->fp);
+        clnt->fp = sock;
+        unlock(clnt->bep);
+
+        write_http_header(clnt, json ? "application/json" : "text/html");
+        fwrite(page, pagelen, 1, clnt->fp);
+        free(page);
+    }
+bail:
+    return closeConnection;
+}
+
+struct prefix_print {
+    FILE       *fp;
+    const char *prefix;
+};
+
+// one stat named "<prefix>:<name>" - the uri in the "all" view (like the
+// get keys), the backend in the fleet view
+static void
+prefixPrintStat(struct stats_entry *entry, void *arg)
+{
+    struct prefix_print *pp = (struct prefix_print *) arg;
+
+    if (entry->type == ALPHA) {
+        fprintf(pp->fp, "STAT %s:%s %s\r\n", pp->prefix, entry->name,
+                entry->v.valueStr);
+    } else {
+        fprintf(pp->fp, "STAT %s:%s %"PRIu64"\r\n", pp->prefix, entry->name,
+                entry->v.value);
+    }
+}
+
+// deliver every stats uri of the backend from the same poll cycle
+static int
+allCallback(void *arg, char *uri)
+{
+    int              closeConnection = TRUE;
+    proxyclient_t    *clnt = (proxyclient_t *) arg;
+    backend_t        *bep = clnt->bep;
+    struct uri_entry *entry;
+    struct prefix_print pp;
+    char             *params;
+    FILE             *sock = clnt->fp;
+    char             *page = NULL;
+    size_t           pagelen = 0;
+
+    if ((params = strchr(uri, '?')) != NULL) {
+        *params++ = '\0';
+        if (clnt->type == HTTP_CLIENT) {
+            parseStatParams(&clnt->filter, params);
+        }
+    }
+
+    // render in memory, the lock covers the one snapshot only
+    clnt->fp = open_memstream(&page, &pagelen);
+    alloc_fail_check(clnt->fp);
+    rdlock(bep);
+    if (bep->state != POLLING) {
+        unlock(bep);
+        fclose(clnt->fp);
+        clnt->fp = sock;
+        free(page);
+        clntError(clnt, HTTP_SERVUNAVAIL, uri);
+        return closeConnection;
+    }
+    if (clnt->type == MEMCACHE_CLIENT) {
+        fprintf(clnt->fp, "STAT snapshot %"PRIu64"\r\n", bep->generation);
+        pp.fp = clnt->fp;
+        TAILQ_FOREACH(entry, &bep->uris, next) {
+            pp.prefix = entry->uri;
+            visitStats(entry, &clnt->filter, prefixPrintStat, &pp);
+        }
+        fprintf(clnt->fp, "END\r\n");
+        closeConnection = FALSE;
+    } else {
+        write_html_body(clnt->fp);
+        write_page_refresh(bep->settings.refreshfreq_ms, clnt->fp);
+        write_html_service_info(clnt, TRUE);
+        fprintf(clnt->fp, "<i>snapshot</i> <b>%"PRIu64"</b><br>",
+                bep->generation);
+        TAILQ_FOREACH(entry, &bep->uris, next) {
+            fprintf(clnt->fp, "<h3>%s</h3>",
+                    entry->uri[0] != '\0' ? entry->uri : "stats");
+            htmlPrintStats(entry->uri, entry, &clnt->filter, clnt->fp);
+        }
+        end_html_body(clnt->fp);
+    }
+    unlock(bep);
+    fclose(clnt->fp);
+    clnt->fp = sock;
+
+    if (clnt->type == HTTP_CLIENT) {
+        write_http_header(clnt, "text/html");
+    }
+    fwrite(page, pagelen, 1, clnt->fp);
+    free(page);
+    return closeConnection;
+}
+
+// does any backend poll this uri
+static bool_t
+fleetHasUri(struct settings *config, const char *uri)
+{
+    backend_t *bep;
+
+    TAILQ_FOREACH(bep, &config->proxies, next) {
+        if (findUriEntry(bep, uri) != NULL) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// one stats uri of every backend in a single response, lines named
+// "<backhost>:<backport>:<name>".  Each backend's published stats are
+// rendered under its read lock, one backend at a time, and written out
+// after the lock is dropped, so a slow client never holds up a poller;
+// backends that aren't polling are left out.  Web
+// requests ask for "fleet/<uri>" and get a chunked stream, telnet clients
+// ask for "stats fleet <uri> [stat ...]".
+static int
+fleetCallback(void *arg, char *uri)
+{
+    int                 closeConnection = TRUE;
+    proxyclient_t       *clnt = (proxyclient_t *) arg;
+    struct settings     *config = clnt->bep->config;
+    stat_filter_t       *filter = &clnt->filter;
+    backend_t           *bep;
+    struct uri_entry    *entry;
+    struct prefix_print pp;
+    const char          *statsUri = "";
+    char                *params;
+    char                name[MAXREQSZ];
+    char                *block;
+    size_t              blocklen;
+    int                 i;
+
+    if ((params = strchr(uri, '?')) != NULL) {
+        *params++ = '\0';
+    }
+    if (clnt->type == HTTP_CLIENT) {
+        if (params != NULL) {
+            parseStatParams(filter, params);
+        }
+        if (strcmp(uri, FLEET_URI) != 0) {
+            statsUri = uri + strlen(FLEET_URI "/");
+        }
+    } else if (filter->count > 0 && fleetHasUri(config, filter->names[0])) {
+        // "stats fleet items items:1:*" - the uri comes first, then stats
+        statsUri = filter->names[0];
+        filter->count--;
+        for (i = 0; i < filter->count; i++) {
+            filter->names[i] = filter->names[i + 1];
+            filter->match[i] = filter->match[i + 1];
+        }
+    }
+    if (!fleetHasUri(config, statsUri)) {
+        clntError(clnt, HTTP_NOTFOUND, uri);
+        return closeConnection;
+    }
+
+    if (clnt->type == HTTP_CLIENT) {
+        write_http_header(clnt, "text/plain");
+    } else {
+        closeConnection = FALSE;
+    }
+    pp.prefix = name;
+    TAILQ_FOREACH(bep, &config->proxies, next) {
+        snprintf(name, sizeof name, "%s:%d", bep->settings.backhost,
+                 bep->settings.backport);
+        block = NULL;
+        blocklen = 0;
+        pp.fp = open_memstream(&block, &blocklen);
+        alloc_fail_check(pp.fp);
+        rdlock(bep);
+        entry = findUriEntry(bep, statsUri);
+        if (entry != NULL && bep->state == POLLING) {
+            visitStats(entry, filter, prefixPrintStat, &pp);
+        }
+        unlock(bep);
+        fclose(pp.fp);
+        fwrite(block, blocklen, 1, clnt->fp);
+        free(block);
+    }
+    fprintf(clnt->fp, "END\r\n");
+    return closeConnection;
+}
+
+// rank the fleet's backends by a stat - "top?stat=<name>[:rate]&n=<n>"
+// on the web, "stats top <name>[:rate] [n]" on telnet
+static int
+topCallback(void *arg, char *uri)
+{
+    int              closeConnection = TRUE;
+    proxyclient_t    *clnt = (proxyclient_t *) arg;
+    const char       *stat = NULL;
+    int              n = DEFAULT_TOP_N;
+    int              count;
+    int              i;
+    char             *params;
+    char             *tok;
+    char             *save;
+    struct top_entry *top;
+    backend_t        *bep;
+    bool_t           json = FALSE;
+
+    if (clnt->type == MEMCACHE_CLIENT) {
+        if (clnt->filter.count > 0) {
+            stat = clnt->filter.names[0];
+        }
+        if (clnt->filter.count > 1) {
+            n = atoi(clnt->filter.names[1]);
+        }
+    } else if ((params = strchr(uri, '?')) != NULL) {
+        *params++ = '\0';
+        json = hasParam(params, "format=json");
+        for (tok = strtok_r(params, "&", &save); tok != NULL;
+             tok = strtok_r(NULL, "&", &save)) {
+            if (strncmp(tok, "stat=", 5) == 0) {
+                stat = tok + 5;
+            } else if (strncmp(tok, "n=", 2) == 0) {
+                n = atoi(tok + 2);
+            }
+        }
+    }
+    if (stat == NULL || n <= 0) {
+        clntError(clnt, HTTP_BADREQUEST, uri);
+        return closeConnection;
+    }
+
+    // no more than there are backends to rank
+    count = 0;
+    TAILQ_FOREACH(bep, &clnt->bep->config->proxies, next) {
+        count++;
+    }
+    n = (n < count) ? n : (count > 0 ? count : 1);
+
+    top = (struct top_entry *) calloc(n, sizeof *top);
+    alloc_fail_check(top);
+    count = top_query(stat, n, timestamp(), top);
+
+    if (clnt->type == MEMCACHE_CLIENT) {
+        for (i = 0; i < count; i++) {
+            fprintf(clnt->fp, "STAT %s:%d %.15g\r\n",
+                    top[i].bep->settings.backhost,
+                    top[i].bep->settings.backport, top[i].value);
+        }
+        fprintf(clnt->fp, "END\r\n");
+        closeConnection = FALSE;
+    } else if (json) {
+        write_http_header(clnt, "application/json");
+        fprintf(clnt->fp, "{\"stat\":");
+        write_json_string(stat, clnt->fp);
+        fprintf(clnt->fp, ",\"top\":[");
+        for (i = 0; i < count; i++) {
+            fprintf(clnt->fp, "%s{\"backend\":\"%s:%d\",\"value\":%.15g}",
+                    i > 0 ? "," : "", top[i].bep->settings.backhost,
+                    top[i].bep->settings.backport, top[i].value);
+        }
+        fprintf(clnt->fp, "]}\n");
+    } else {
+        write_http_header(clnt, "text/html");
+        write_html_body(clnt->fp);
+        write_page_refresh(clnt->bep->settings.refreshfreq_ms, clnt->fp);
+        write_html_service_info(clnt, TRUE);
+        fprintf(clnt->fp, "<b>Top %d backends by <i>", n);
+        write_html_string(stat, clnt->fp);
+        fprintf(clnt->fp, "</i></b><br><table>");
+        for (i = 0; i < count; i++) {
+            fprintf(clnt->fp, "<tr><td>%d</td><td>%s:%d</td>"
+                    "<td align=\"right\"><b>%.15g</b></td></tr>",
+                    i + 1, top[i].bep->settings.backhost,
+                    top[i].bep->settings.backport, top[i].value);
+        }
+        fprintf(clnt->fp, "</table>");
+        end_html_body(clnt->fp);
+    }
+    free(top);
+    return closeConnection;
+}
+
+static const char *latencyNames[NUM_LATENCY_METRICS] = {
+    "liveness", "poll", "set", "get", "delete", "drift"
+};
+static const double latencyQuantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char *quantileNames[] = { "p50", "p90", "p99", "p999" };
+#define NUM_QUANTILES ((int) (sizeof latencyQuantiles / sizeof (double)))
+
+// one row of the latency view, percentiles in milliseconds
+static void
+latencyPrintRow(proxyclient_t *clnt, bool_t json, bool_t *first,
+                const char *name, enum latency_metric metric,
+                struct sketch *sk)
+{
+    int i;
+
+    if (clnt->type == MEMCACHE_CLIENT) {
+        fprintf(clnt->fp, "STAT %s:%s:count %"PRIu64"\r\n", name,
+                latencyNames[metric], sk->count);
+        for (i = 0; i < NUM_QUANTILES; i++) {
+            fprintf(clnt->fp, "STAT %s:%s:%s %.3f\r\n", name,
+                    latencyNames[metric], quantileNames[i],
+                    sketch_quantile(sk, latencyQuantiles[i]) / 1000);
+        }
+    } else if (json) {
+        fprintf(clnt->fp, "%s{\"name\":", *first ? "" : ",");
+        write_json_string(name, clnt->fp);
+        fprintf(clnt->fp, ",\"metric\":\"%s\",\"count\":%"PRIu64,
+                latencyNames[metric], sk->count);
+        for (i = 0; i < NUM_QUANTILES; i++) {
+            fprintf(clnt->fp, ",\"%s\":%.3f", quantileNames[i],
+                    sketch_quantile(sk, latencyQuantiles[i]) / 1000);
+        }
+        fputc('}', clnt->fp);
+    } else {
+        fprintf(clnt->fp, "<tr><td>%s</td><td>%s</td>"
+                "<td align=\"right\">%"PRIu64"</td>", name,
+                latencyNames[metric], sk->count);
+        for (i = 0; i < NUM_QUANTILES; i++) {
+            fprintf(clnt->fp, "<td align=\"right\">%.3f</td>",
+                    sketch_quantile(sk, latencyQuantiles[i]) / 1000);
+        }
+        fprintf(clnt->fp, "</tr>");
+    }
+    *first = FALSE;
+}
+
+// liveness, poll round trip and drift percentiles over the last minutes - per
+// backend, merged per pool and merged across the fleet.  Web requests use
+// "latency?minutes=<n>", telnet clients "stats latency [minutes]".
+static int
+latencyCallback(void *arg, char *uri)
+{
+    int             closeConnection = TRUE;
+    proxyclient_t   *clnt = (proxyclient_t *) arg;
+    struct settings *config = clnt->bep->config;
+    backend_t       *bep;
+    backend_t       *other;
+    struct sketch   sk;
+    int             minutes = DEFAULT_LATENCY_MINUTES;
+    int             m;
+    bool_t          json = FALSE;
+    bool_t          first = TRUE;
+    bool_t          seen;
+    char            name[MAXREQSZ];
+    char            *params;
+    char            *tok;
+    char            *save;
+
+    if (clnt->type == MEMCACHE_CLIENT) {
+        if (clnt->filter.count > 0) {
+            minutes = atoi(clnt->filter.names[0]);
+        }
+    } else if ((params = strchr(uri, '?')) != NULL) {
+        *params++ = '\0';
+        json = hasParam(params, "format=json");
+        for (tok = strtok_r(params, "&", &save); tok != NULL;
+             tok = strtok_r(NULL, "&", &save)) {
+            if (strncmp(tok, "minutes=", 8) == 0) {
+                minutes = atoi(tok + 8);
+            }
+        }
+    }
+    if (minutes <= 0) {
+        clntError(clnt, HTTP_BADREQUEST, uri);
+        return closeConnection;
+    }
+
+    if (clnt->type == MEMCACHE_CLIENT) {
+        closeConnection = FALSE;
+    } else if (json) {
+        write_http_header(clnt, "application/json");
+        fprintf(clnt->fp, "{\"minutes\":%d,\"latency\":[", minutes);
+    } else {
+        write_http_header(clnt, "text/html");
+        write_html_body(clnt->fp);
+        write_page_refresh(clnt->bep->settings.refreshfreq_ms, clnt->fp);
+        write_html_service_info(clnt, TRUE);
+        fprintf(clnt->fp, "<b>Latency (ms) over the last %d minutes</b><br>"
+                "<table><tr><th></th><th></th><th>count</th>", minutes);
+        for (m = 0; m < NUM_QUANTILES; m++) {
+            fprintf(clnt->fp, "<th>%s</th>", quantileNames[m]);
+        }
+        fprintf(clnt->fp, "</tr>");
+    }
+
+    for (m = 0; m < NUM_LATENCY_METRICS; m++) {
+        enum latency_metric metric = (enum latency_metric) m;
+
+        // each backend
+        TAILQ_FOREACH(bep, &config->proxies, next) {
+            sketch_init(&sk);
+            latency_merge(bep->latency, metric, minutes, &sk);
+            snprintf(name, sizeof name, "%s:%d", bep->settings.backhost,
+                     bep->settings.backport);
+            latencyPrintRow(clnt, json, &first, name, metric, &sk);
+            sketch_free(&sk);
+        }
+
+        // each pool, the first time one of its members comes up
+        TAILQ_FOREACH(bep, &config->proxies, next) {
+            if (bep->settings.pool == NULL) {
+                continue;
+            }
+            seen = FALSE;
+            for (other = TAILQ_FIRST(&config->proxies); other != bep;
+                 other = TAILQ_NEXT(other, next)) {
+                if (other->settings.pool != NULL &&
+                    strcmp(other->settings.pool, bep->settings.pool) == 0) {
+                    seen = TRUE;
+                    break;
+                }
+            }
+            if (seen) {
+                continue;
+            }
+            sketch_init(&sk);
+            for (other = bep; other != NULL; other = TAILQ_NEXT(other, next)) {
+                if (other->settings.pool != NULL &&
+                    strcmp(other->settings.pool, bep->settings.pool) == 0) {
+                    latency_merge(other->latency, metric, minutes, &sk);
+                }
+            }
+            snprintf(name, sizeof name, "pool:%s", bep->settings.pool);
+            latencyPrintRow(clnt, json, &first, name, metric, &sk);
+            sketch_free(&sk);
+        }
+
+        // the whole fleet
+        sketch_init(&sk);
+        TAILQ_FOREACH(bep, &config->proxies, next) {
+            latency_merge(bep->latency, metric, minutes, &sk);
+        }
+        latencyPrintRow(clnt, json, &first, "fleet", metric, &sk);
+        sketch_free(&sk);
+    }
+
+    if (clnt->type == MEMCACHE_CLIENT) {
+        fprintf(clnt->fp, "END\r\n");
+    } else if (json) {
+        fprintf(clnt->fp, "]}\n");
+    } else {
+        fprintf(clnt->fp, "</table>");
+        end_html_body(clnt->fp);
+    }
+    return closeConnection;
+}
+
+static const char *tierNames[NUM_TIERS] = { "raw", "1m", "1h" };
+
+// the stat aggregated into buckets of step seconds, from the coarsest
+// rollup that fits in a step
+static void
+historyRange(proxyclient_t *clnt, bool_t json, const char *stat,
+             time_t from, time_t to, int step)
+{
+    struct history_bucket *b = NULL;
+    enum history_tier     tier = TIER_RAW;
+    bool_t                first = TRUE;
+    int                   count;
+    int                   i;
+
+    count = history_range(clnt->bep->history, stat, from, to, &step, &b,
+                          &tier);
+    if (count < 0) {
+        clntError(clnt, HTTP_BADREQUEST, (char *) stat);
+        return;
+    }
+
+    if (clnt->type == MEMCACHE_CLIENT) {
+        fprintf(clnt->fp, "STAT step %d\r\nSTAT tier %s\r\n", step,
+                tierNames[tier]);
+    } else if (json) {
+        write_http_header(clnt, "application/json");
+        fprintf(clnt->fp, "{\"stat\":");
+        write_json_string(stat, clnt->fp);
+        fprintf(clnt->fp, ",\"step\":%d,\"tier\":\"%s\",\"buckets\":[",
+                step, tierNames[tier]);
+    } else {
+        write_http_header(clnt, "text/html");
+        write_html_body(clnt->fp);
+        write_page_refresh(clnt->bep->settings.refreshfreq_ms, clnt->fp);
+        write_html_service_info(clnt, TRUE);
+        fprintf(clnt->fp, "<b>History of <i>");
+        write_html_string(stat, clnt->fp);
+        fprintf(clnt->fp, "</i> per %d seconds (%s)</b>"
+                "<br><table><tr><th></th><th>count</th><th>min</th>"
+                "<th>max</th><th>avg</th><th>rate</th></tr>", step,
+                tierNames[tier]);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (b[i].count == 0) {
+            continue;
+        }
+        if (clnt->type == MEMCACHE_CLIENT) {
+            fprintf(clnt->fp, "STAT %ld:count %"PRIu64"\r\n"
+                    "STAT %ld:min %"PRIu64"\r\n"
+                    "STAT %ld:max %"PRIu64"\r\n"
+                    "STAT %ld:avg %.3f\r\n",
+                    (long) b[i].start, b[i].count, (long) b[i].start, b[i].min,
+                    (long) b[i].start, b[i].max, (long) b[i].start,
+                    (double) b[i].sum / b[i].count);
+            if (b[i].hasRate) {
+                fprintf(clnt->fp, "STAT %ld:rate %.3f\r\n",
+                        (long) b[i].start, b[i].rate);
+            }
+        } else if (json) {
+            fprintf(clnt->fp, "%s{\"t\":%ld,\"count\":%"PRIu64",\"min\":%"PRIu64
+                    ",\"max\":%"PRIu64",\"avg\":%.3f,\"rate\":",
+                    first ? "" : ",", (long) b[i].start, b[i].count,
+                    b[i].min, b[i].max, (double) b[i].sum / b[i].count);
+            if (b[i].hasRate) {
+                fprintf(clnt->fp, "%.3f}", b[i].rate);
+            } else {
+                fprintf(clnt->fp, "null}");
+            }
+        } else {
+            char date[DATEBUFSZ];
+
+            ctime_r(&b[i].start, date);
+            date[strlen(date) - 1] = '\0'; // zap newline
+            fprintf(clnt->fp, "<tr><td>%s</td>"
+                    "<td align=\"right\">%"PRIu64"</td>"
+                    "<td align=\"right\">%"PRIu64"</td>"
+                    "<td align=\"right\">%"PRIu64"</td>"
+                    "<td align=\"right\">%.3f</td><td align=\"right\">",
+                    date, b[i].count, b[i].min, b[i].max,
+                    (double) b[i].sum / b[i].count);
+            if (b[i].hasRate) {
+                fprintf(clnt->fp, "%.3f", b[i].rate);
+            }
+            fprintf(clnt->fp, "</td></tr>");
+        }
+        first = FALSE;
+    }
+
+    if (clnt->type == MEMCACHE_CLIENT) {
+        fprintf(clnt->fp, "END\r\n");
+    } else if (json) {
+        fprintf(clnt->fp, "]}\n");
+    } else {
+        fprintf(clnt->fp, "</table>");
+        end_html_body(clnt->fp);
+    }
+    free(b);
+}
+
+// a stat's history - "history?stat=<uri>:<name>&seconds=<n>" (or
+// "&from=<time>&to=<time>") on the web, "stats history <uri>:<name>
+// [seconds [step]]" on telnet.  A step (or "buckets=<n>" on the web)
+// aggregates the points into buckets.  Without a stat it tells how much
+// is kept.
+static int
+historyCallback(void *arg, char *uri)
+{
+    int                  closeConnection = TRUE;
+    proxyclient_t        *clnt = (proxyclient_t *) arg;
+    struct history       *h = clnt->bep->history;
+    struct history_point *points = NULL;
+    struct history_usage usage;
+    const char           *stat = NULL;
+    time_t               now = time(0);
+    time_t               from = 0;
+    time_t               to = now;
+    int                  seconds = DEFAULT_HISTORY_SECONDS;
+    int                  step = 0;
+    int                  buckets = 0;
+    int                  count = 0;
+    int                  i;
+    char                 *params;
+    char                 *tok;
+    char                 *save;
+    bool_t               json = FALSE;
+
+    if (clnt->type == MEMCACHE_CLIENT) {
+        if (clnt->filter.count > 0) {
+            stat = clnt->filter.names[0];
+        }
+        if (clnt->filter.count > 1) {
+            seconds = atoi(clnt->filter.names[1]);
+        }
+        if (clnt->filter.count > 2) {
+            step = atoi(clnt->filter.names[2]);
+            buckets = -1;
+        }
+    } else if ((params = strchr(uri, '?')) != NULL) {
+        *params++ = '\0';
+        json = hasParam(params, "format=json");
+        for (tok = strtok_r(params, "&", &save); tok != NULL;
+             tok = strtok_r(NULL, "&", &save)) {
+            if (strncmp(tok, "stat=", 5) == 0) {
+                stat = tok + 5;
+            } else if (strncmp(tok, "seconds=", 8) == 0) {
+                seconds = atoi(tok + 8);
+            } else if (strncmp(tok, "from=", 5) == 0) {
+                from = strtol(tok + 5, NULL, 10);
+            } else if (strncmp(tok, "to=", 3) == 0) {
+                to = strtol(tok + 3, NULL, 10);
+            } else if (strncmp(tok, "step=", 5) == 0) {
+                step = atoi(tok + 5);
+                buckets = -1;
+            } else if (strncmp(tok, "buckets=", 8) == 0) {
+                buckets = atoi(tok + 8);
+            }
+        }
+    }
+    if (from == 0) {
+        from = to - seconds;
+    }
+    if (buckets > 0 && to >= from && from >= 0) {
+        // out of range steps are turned away by the query
+        time_t span = (to - from + buckets - 1) / buckets;
+
+        step = (span > HISTORY_MAX_STEP) ? HISTORY_MAX_STEP + 1 :
+               (span > 0) ? (int) span : 1;
+    }
+    if (seconds <= 0 || from < 0 || to < from ||
+        (buckets != 0 && step <= 0)) {
+        clntError(clnt, HTTP_BADREQUEST, uri);
+        return closeConnection;
+    }
+
+    if (stat == NULL) {
+        history_usage(h, &usage);
+        if (clnt->type == MEMCACHE_CLIENT) {
+            fprintf(clnt->fp, "STAT series %"PRIu64"\r\n"
+                    "STAT points %"PRIu64"\r\n"
+                    "STAT bytes %"PRIu64"\r\n"
+                    "STAT bits_per_point %.2f\r\n"
+                    "END\r\n", usage.series, usage.points, usage.bytes,
+                    usage.points ? (double) usage.bits / usage.points : 0);
+            closeConnection = FALSE;
+        } else if (json) {
+            write_http_header(clnt, "application/json");
+            fprintf(clnt->fp, "{\"series\":%"PRIu64",\"points\":%"PRIu64","
+                    "\"bytes\":%"PRIu64",\"bits_per_point\":%.2f}\n",
+                    usage.series, usage.points, usage.bytes,
+                    usage.points ? (double) usage.bits / usage.points : 0);
+        } else {
+            write_http_header(clnt, "text/html");
+            write_html_body(clnt->fp);
+            write_html_service_info(clnt, TRUE);
+            fprintf(clnt->fp, "<b>History</b><br><table>"
+                    "<tr><td>series</td><td align=\"right\">%"PRIu64"</td></tr>"
+                    "<tr><td>points</td><td align=\"right\">%"PRIu64"</td></tr>"
+                    "<tr><td>bytes</td><td align=\"right\">%"PRIu64"</td></tr>"
+                    "<tr><td>bits per point</td><td align=\"right\">%.2f</td>"
+                    "</tr></table>", usage.series, usage.points, usage.bytes,
+                    usage.points ? (double) usage.bits / usage.points : 0);
+            end_html_body(clnt->fp);
+        }
+        return closeConnection;
+    }
+
+    if (buckets != 0) {
+        historyRange(clnt, json, stat, from, to, step);
+        return clnt->type != MEMCACHE_CLIENT;
+    }
+
+    count = history_query(h, stat, from, to, &points);
+    if (clnt->type == MEMCACHE_CLIENT) {
+        for (i = 0; i < count; i++) {
+            fprintf(clnt->fp, "STAT %ld %"PRIu64"\r\n", (long) points[i].t,
+                    points[i].value);
+        }
+        fprintf(clnt->fp, "END\r\n");
+        closeConnection = FALSE;
+    } else if (json) {
+        write_http_header(clnt, "application/json");
+        fprintf(clnt->fp, "{\"stat\":");
+        write_json_string(stat, clnt->fp);
+        fprintf(clnt->fp, ",\"from\":%ld,\"to\":%ld,\"points\":[",
+                (long) from, (long) to);
+        for (i = 0; i < count; i++) {
+            fprintf(clnt->fp, "%s[%ld,%"PRIu64"]", i > 0 ? "," : "",
+                    (long) points[i].t, points[i].value);
+        }
+        fprintf(clnt->fp, "]}\n");
+    } else {
+        write_http_header(clnt, "text/html");
+        write_html_body(clnt->fp);
+        write_page_refresh(clnt->bep->settings.refreshfreq_ms, clnt->fp);
+        write_html_service_info(clnt, TRUE);
+        fprintf(clnt->fp, "<b>History of <i>");
+        write_html_string(stat, clnt->fp);
+        fprintf(clnt->fp, "</i></b><br><table>");
+        for (i = 0; i < count; i++) {
+            char date[DATEBUFSZ];
+
+            ctime_r(&points[i].t, date);
+            date[strlen(date) - 1] = '\0'; // zap newline
+            fprintf(clnt->fp, "<tr><td>%s</td><td align=\"right\">"
+                    "%"PRIu64"</td></tr>", date, points[i].value);
+        }
+        fprintf(clnt->fp, "</table>");
+        end_html_body(clnt->fp);
+    }
+    free(points);
+    return closeConnection;
+}
+
+// memcache get of single stats - each key is "stat:<uri>:<name>" and is
+// answered with a VALUE block straight from the uri's name index; keys
+// that don't name a stat are left out, as memcached does for misses
+static int
+getCallback(void *arg, char *uri)
+{
+    proxyclient_t      *clnt = (proxyclient_t *) arg;
+    backend_t          *bep = clnt->bep;
+    stat_filter_t      *keys = &clnt->filter;
+    struct uri_entry   *entry;
+    struct stats_entry *stat;
+    char               statUri[MAXREQSZ];
+    char               valueBuf[32];
+    const char         *key;
+    const char         *name;
+    const char         *value;
+    int                i;
+
+    rdlock(bep);
+    for (i = 0; i < keys->count && bep->state == POLLING; i++) {
+        key = keys->names[i];
+        if (strncmp(key, STAT_KEY_PREFIX, strlen(STAT_KEY_PREFIX)) != 0) {
+            continue;
+        }
+        key += strlen(STAT_KEY_PREFIX);
+        name = strchr(key, ':');
+        if (name == NULL) {
+            continue;
+        }
+        snprintf(statUri, sizeof statUri, "%.*s", (int) (name - key), key);
+        name++;
+
+        entry = findUriEntry(bep, statUri);
+        if (entry == NULL || (stat = findStat(entry, name)) == NULL) {
+            continue;
+        }
+        if (stat->type == ALPHA) {
+            value = stat->v.valueStr;
+        } else {
+            snprintf(valueBuf, sizeof valueBuf, "%"PRIu64, stat->v.value);
+            value = valueBuf;
+        }
+        if (strcmp(clnt->method, "gets") == 0) {
+            // the poll generation doubles as the cas unique
+            fprintf(clnt->fp, "VALUE %s 0 %d %"PRIu64"\r\n%s\r\n",
+                    keys->names[i], (int) strlen(value), entry->generation,
+                    value);
+        } else {
+            fprintf(clnt->fp, "VALUE %s 0 %d\r\n%s\r\n",
+                    keys->names[i], (int) strlen(value), value);
+        }
+    }
+    unlock(bep);
+    fprintf(clnt->fp, "END\r\n");
+    return FALSE;
+}
+
+// has the client hung up (or sent more input) while we were streaming
+static bool_t
+clientReadable(proxyclient_t *clnt)
+{
+    struct pollfd pfd;
+
+    pfd.fd = clnt->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) > 0;
+}
+
+// drop a reference to a stream update
+static void
+releaseEvent(struct sse_event *event)
+{
+    if (event != NULL && __sync_sub_and_fetch(&event->refs, 1) == 0) {
+        free(event->data);
+        free(event);
+    }
+}
+
+// get the stream update for the uri's current stats - it is serialized
+// once per poll generation and shared by all of the uri's subscribers
+static struct sse_event *
+getEvent(backend_t *bep, struct uri_entry *entry)
+{
+    struct sse_event *event = NULL;
+    FILE             *fp;
+
+    rdlock(bep);
+    if (bep->state != POLLING || entry->generation == 0) {
+        unlock(bep);
+        return NULL;
+    }
+    pthread_mutex_lock(&bep->genLock);
+    if (entry->event == NULL || entry->event->generation != entry->generation) {
+        event = (struct sse_event *) calloc(1, sizeof *event);
+        alloc_fail_check(event);
+        event->refs = 1; // the uri's reference
+        event->generation = entry->generation;
+        fp = open_memstream(&event->data, &event->len);
+        alloc_fail_check(fp);
+        fprintf(fp, "id: %"PRIu64"\nevent: stats\n"
+                    "data: {\"generation\":%"PRIu64",\"uri\":",
+                    event->generation, event->generation);
+        write_json_string(entry->uri, fp);
+        fprintf(fp, ",\"stats\":");
+        jsonPrintStats(entry, NULL, fp);
+        fprintf(fp, "}\n\n");
+        fclose(fp);
+        releaseEvent(entry->event);
+        entry->event = event;
+    }
+    event = entry->event;
+    __sync_fetch_and_add(&event->refs, 1);
+    pthread_mutex_unlock(&bep->genLock);
+    unlock(bep);
+    return event;
+}
+
+// wait for the backend to finish a poll cycle after generation 'seen' -
+// ETIMEDOUT if none did within timeout_ms
+static int
+waitForPoll(backend_t *bep, uint64_t seen, int timeout_ms)
+{
+    int             err = 0;
+    struct timeval  now;
+    struct timespec deadline;
+
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + timeout_ms / NUM_MSECS_PER_SEC;
+    deadline.tv_nsec = now.tv_usec * 1000 +
+                       (timeout_ms % NUM_MSECS_PER_SEC) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&bep->genLock);
+    while (bep->generation == seen && err == 0) {
+        err = pthread_cond_timedwait(&bep->genCond, &bep->genLock, &deadline);
+    }
+    pthread_mutex_unlock(&bep->genLock);
+    return err;
+}
+
+// the backend's current poll generation
+static uint64_t
+pollGeneration(backend_t *bep)
+{
+    uint64_t generation;
+
+    pthread_mutex_lock(&bep->genLock);
+    generation = bep->generation;
+    pthread_mutex_unlock(&bep->genLock);
+    return generation;
+}
+
+// stream a stats uri as server-sent events - one update for every poll
+// generation that changed the uri's stats, and nothing in between
+static int
+eventsCallback(void *arg, char *uri)
+{
+    proxyclient_t    *clnt = (proxyclient_t *) arg;
+    backend_t        *bep = clnt->bep;
+    struct uri_entry *entry;
+    struct sse_event *event;
+    uint64_t         seen;
+    uint64_t         sent = 0;
+    char             *params;
+
+    if ((params = strchr(uri, '?')) != NULL) {
+        *params = '\0';
+    }
+    entry = findEventsUri(bep, uri);
+    if (entry == NULL) {
+        clntError(clnt, HTTP_NOTFOUND, uri);
+        return TRUE;
+    }
+
+    fprintf(clnt->fp,
+        "HTTP/%d.%d %d OK\r\n"
+        "Server: Gear6 Memcached\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Content-type: text/event-stream\r\n\r\n"
+        "retry: %d\n\n",
+        HTTP_MAJOR, HTTP_MINOR, HTTP_OK, bep->settings.refreshfreq_ms);
+
+    for (;;) {
+        seen = pollGeneration(bep);
+        event = getEvent(bep, entry);
+        if (event != NULL && event->generation != sent) {
+            fwrite(event->data, event->len, 1, clnt->fp);
+            sent = event->generation;
+        }
+        releaseEvent(event);
+        if (fflush(clnt->fp) != 0) {
+            break; // subscriber went away
         }
-        if (entry->type == ALPHA) {
-            fprintf(fp, "STAT %s %s\r\n", entry->name, entry->v.valueStr);
-        } else {
-            fprintf(fp, "STAT %s %"PRIu64"\r\n", entry->name, entry->v.value);
+        if (waitForPoll(bep, seen, STREAM_KEEPALIVE_MS) == ETIMEDOUT) {
+            fprintf(clnt->fp, ": keepalive\n\n");
         }
-    }
-    fprintf(fp, "END\r\n");
-}
-
-static void
-htmlPrintStats(char *uri, struct uri_entry *uri_entry, FILE *fp)
-{
-    struct stats_entry *entry;
-
-    TAILQ_FOREACH(entry, &uri_entry->stats, next) {
-        if (entry->type == ALPHA) {
-            fprintf(fp,
-                    "<font size=\"-2\">STAT</font> <i>%s</i> <b>%s</b><br>",
-                    entry->name, entry->v.valueStr);
-        } else {
-            fprintf(fp,
-                    "<font size=\"-2\">STAT</font> <i>%s</i> <b>%"PRIu64
-                    "</b><br>",
-                    entry->name, entry->v.value);
+        if (clientReadable(clnt)) {
+            break; // browsers send nothing on a stream - this is a hangup
         }
     }
+    return TRUE;
 }
 
-// deliver cached stats
+// stream a stats uri over telnet - the STAT block is sent after every poll
+// that changed it, cut down to the stats named in the request if any.
+// Any input from the client ends the watch.
 static int
-statsCallback(void *arg, char *uri)
+watchCallback(void *arg, char *uri)
 {
-    int              closeConnection = TRUE;
     proxyclient_t    *clnt = (proxyclient_t *) arg;
     backend_t        *bep = clnt->bep;
-    struct           uri_entry *entry = NULL;
+    struct uri_entry *entry;
+    uint64_t         seen;
+    uint64_t         sent = 0;
+    char             *block;
+    size_t           blocklen;
+    FILE             *fp;
 
-    // find the uri
-    TAILQ_FOREACH(entry, &bep->uris, next) {
-        if (strcmp(entry->uri, uri) == 0) {
-            break;
-        }
-    }
+    entry = findUriEntry(bep, uri);
     if (entry == NULL) {
         clntError(clnt, HTTP_NOTFOUND, uri);
-        goto bail;
+        return FALSE;
     }
-    rdlock(clnt->bep);
 
-    if (clnt->bep->state != POLLING) {
-        clntError(clnt, HTTP_SERVUNAVAIL, uri);
-        unlock(clnt->bep);
-        goto bail;
-    }
+    for (;;) {
+        seen = pollGeneration(bep);
+        block = NULL;
+        blocklen = 0;
+
+        // render under the lock, write after dropping it
+        rdlock(bep);
+        if (bep->state == POLLING && entry->generation != sent) {
+            fp = open_memstream(&block, &blocklen);
+            alloc_fail_check(fp);
+            rawPrintStats(uri, entry, &clnt->filter, fp);
+            fclose(fp);
+            sent = entry->generation;
+        }
+        unlock(bep);
 
-    // deliver the stays chain hanging off of it
-    if (clnt->type == MEMCACHE_CLIENT) {
-        rawPrintStats(uri, entry, clnt->fp);
-        closeConnection = FALSE;
-    } else {
-        write_http_header("text/html", clnt->fp);
-        write_html_body(clnt->fp);
-        write_page_refresh(clnt->bep->settings.refreshfreq_ms, clnt->fp);
-        write_html_service_info(clnt, TRUE);
-        htmlPrintStats(uri, entry, clnt->fp);
-        end_html_body(clnt->fp);
+        if (block != NULL) {
+            fwrite(block, blocklen, 1, clnt->fp);
+            free(block);
+            if (fflush(clnt->fp) != 0) {
+                return TRUE; // watcher went away
+            }
+        }
+        waitForPoll(bep, seen, STREAM_KEEPALIVE_MS);
+        if (clientReadable(clnt)) {
+            return FALSE; // back to reading commands (or EOF)
+        }
     }
-    unlock(clnt->bep);
-bail:
-    return closeConnection;
 }
 
 // system uri for reporter interface
@@ -593,7 +2342,7 @@ reporterCallback(void *arg, char *uri)
 
     // configuration uri
     if (strcmp(uri, "mcr-config") == 0) {
-        write_http_header("text/html", clnt->fp);
+        write_http_header(clnt, "text/html");
         write_html_body(clnt->fp);
         write_html_service_info(clnt, FALSE);
         err = write_html_mcr_config(clnt, uri);
@@ -611,7 +2360,7 @@ reporterCallback(void *arg, char *uri)
                strcmp(uri, "top-keys-select") == 0) {
 
         char *op = &uri[9];
-        write_http_header("text/html", clnt->fp);
+        write_http_header(clnt, "text/html");
         write_html_body(clnt->fp);
         write_page_refresh(MCRREFRESH, clnt->fp);
         write_html_service_info(clnt, FALSE);
@@ -631,7 +2380,7 @@ reporterCallback(void *arg, char *uri)
     // top clients uri
     } else if (strcmp(uri, "top-clients-ops") == 0 ||
                strcmp(uri, "top-clients-keys") == 0) {
-        write_http_header("text/html", clnt->fp);
+        write_http_header(clnt, "text/html");
         write_html_body(clnt->fp);
         write_page_refresh(MCRREFRESH, clnt->fp);
         write_html_service_info(clnt, FALSE);
@@ -653,14 +2402,14 @@ reporterCallback(void *arg, char *uri)
                strcmp(uri, "mcr-disable") == 0) {
 
         if (addr == NULL || port == 0) {
-            write_http_header("text/html", clnt->fp);
+            write_http_header(clnt, "text/html");
             fprintf(clnt->fp, "Error: addr+port+key parameters not specified");
             end_html_body(clnt->fp);
         } else {
             err = mcr_op(clnt, strcmp(uri, "mcr-enable") == 0 ? "add" : "del",
                          addr, port);
             if (err) {
-                write_http_header("text/html", clnt->fp);
+                write_http_header(clnt, "text/html");
                 fprintf(clnt->fp, "System error setting reporter params -"
                               "please check logs for more information");
                 end_html_body(clnt->fp);
@@ -681,13 +2430,119 @@ imageCallback(void *arg, char *uri)
 {
     proxyclient_t *clnt = (proxyclient_t *) arg;
     if (strcmp(uri, "logo.png") == 0) {
-        write_html_image(clnt->fp, sysLogo, sizeof sysLogo);
+        write_html_image(clnt, sysLogo, sizeof sysLogo);
     } else {
         clntError(clnt, HTTP_NOTFOUND, uri);
     }
     return TRUE;
 }
 
+// does a word name (or match) a stat of the basic stats
+static bool_t
+isBasicStat(backend_t *bep, const char *word)
+{
+    struct uri_entry *entry;
+    bool_t           found = FALSE;
+    int              i;
+
+    if (schema_find(word) >= 0) {
+        return TRUE;
+    }
+    rdlock(bep);
+    entry = findUriEntry(bep, "");
+    for (i = 0; entry != NULL && !found && i < entry->stats->count; i++) {
+        found = (fnmatch(word, entry->stats->entries[i].name, 0) == 0);
+    }
+    unlock(bep);
+    return found;
+}
+
+// pull the stat names off a telnet request ("stats <uri> name ...").
+// When the first word isn't a stats uri but names a basic stat, all the
+// words are names from the basic stats, so "stats get_hits" works like
+// "stats \"\" get_hits"; any other word is left as an unknown uri.
+static void
+parseStatArgs(proxyclient_t *clnt, char *uri, const char *args)
+{
+    stat_filter_t *filter = &clnt->filter;
+    char          *tok;
+    char          *next = NULL;
+    char          *save;
+
+    filter->count = 0;
+    filter->hasSince = FALSE;
+    if (uri[0] != '\0' && findCallback(clnt, uri) == NULL &&
+        findUriEntry(clnt->bep, "") != NULL && isBasicStat(clnt->bep, uri)) {
+        snprintf(filter->buf, sizeof filter->buf, "%s %s", uri, args);
+        uri[0] = '\0';
+    } else {
+        snprintf(filter->buf, sizeof filter->buf, "%s", args);
+    }
+
+    // "since <generation>" asks for the stats changed after it
+    tok = strtok_r(filter->buf, " \t\r\n", &save);
+    while (tok != NULL) {
+        if (strcmp(tok, "since") == 0 && (next = strtok_r(NULL, " \t\r\n",
+                                                         &save)) != NULL &&
+            strspn(next, "0123456789") == strlen(next)) {
+            filter->since = strtoull(next, NULL, 10);
+            filter->hasSince = TRUE;
+        } else {
+            addStatFilter(filter, tok, MATCH_NAME);
+            if (next != NULL) {
+                addStatFilter(filter, next, MATCH_NAME);
+            }
+        }
+        next = NULL;
+        tok = strtok_r(NULL, " \t\r\n", &save);
+    }
+}
+
+// pull the keys off a memcache get ("get <key> [<key> ...]")
+static void
+parseGetKeys(proxyclient_t *clnt, const char *key, const char *args)
+{
+    stat_filter_t *keys = &clnt->filter;
+    char          *tok;
+    char          *save;
+
+    keys->count = 0;
+    keys->hasSince = FALSE;
+    snprintf(keys->buf, sizeof keys->buf, "%s %s", key, args);
+    tok = strtok_r(keys->buf, " \t\r\n", &save);
+    while (tok != NULL && keys->count < MAXSTATARGS) {
+        keys->names[keys->count] = tok;
+        keys->match[keys->count] = MATCH_NAME;
+        keys->count++;
+        tok = strtok_r(NULL, " \t\r\n", &save);
+    }
+}
+
+// read the rest of a web request - the version and the Connection header
+// decide whether the connection stays open for another request
+static void
+readHttpHeaders(proxyclient_t *clnt, const char *rest)
+{
+    char version[16] = "";
+    char line[MAXREQSZ];
+
+    sscanf(rest, "%15s", version);
+    clnt->http11 = (strcmp(version, "HTTP/1.1") == 0);
+    clnt->keepAlive = clnt->http11;
+    if (version[0] == '\0') {
+        return; // HTTP/0.9 requests have no headers
+    }
+    while (fgets(line, sizeof line, clnt->in) != NULL) {
+        if (line[0] == '\r' || line[0] == '\n') {
+            break;
+        }
+        if (strncasecmp(line, "Connection:", 11) == 0 &&
+            strcasestr(line + 11, "close") != NULL) {
+            clnt->keepAlive = FALSE;
+        }
+    }
+}
+
 // process inbound telnet or web requests
 static void *
 handleFrontendRequest(void *arg)
@@ -695,18 +2550,36 @@ handleFrontendRequest(void *arg)
     proxyclient_t     *clnt = (proxyclient_t *) arg;
     int               sock = clnt->fd;
     callback_t        cb;
+    struct lane       *lane;
+    int               argsOff;
     char              servRequest[MAXREQSZ];
     char              uri[MAXREQSZ];
     char              method[MAXREQSZ];
     FILE              *serv;
+    FILE              *in;
+    int               insock;
 
-    if ((serv = fdopen(sock, "a+")) == NULL) {
+    // requests are read and replies written through streams of their own,
+    // so a request pipelined behind another stays buffered for the next
+    // read rather than being lost when the reply is written
+    if ((serv = fdopen(sock, "w")) == NULL) {
         proxylog(LOG_ERR, "could not open file pointer to socket (%d)", sock);
         close (sock);
+        free(clnt);
+        return NULL;
+    }
+    if ((insock = dup(sock)) < 0 || (in = fdopen(insock, "r")) == NULL) {
+        proxylog(LOG_ERR, "could not open file pointer to socket (%d)", sock);
+        if (insock >= 0) {
+            close(insock);
+        }
+        fclose(serv);
+        free(clnt);
         return NULL;
     }
 
     clnt->fp = serv;
+    clnt->in = in;
 
     int done = FALSE;
     while (!done) {
@@ -714,10 +2587,12 @@ handleFrontendRequest(void *arg)
         memset(uri, 0, MAXREQSZ);
         memset(method, 0, MAXREQSZ);
         // pull the server request
-        if (fgets(servRequest, MAXREQSZ, serv) == NULL) {
+        if (fgets(servRequest, MAXREQSZ, in) == NULL) {
             goto end;
         }
-        sscanf(servRequest, "%15s %1000s", method, uri);
+        argsOff = 0;
+        sscanf(servRequest, "%15s %1000s%n", method, uri, &argsOff);
+        clnt->framed = FALSE;
 
         if (badMethod(method) || uri == NULL) {
             clntError(clnt, HTTP_BADREQUEST, uri);
@@ -725,9 +2600,15 @@ handleFrontendRequest(void *arg)
         } else {
             setClientType(clnt, method);
             if (clnt->type == HTTP_CLIENT) {
-                // line buffer to make more interactive
-                setlinebuf(clnt->fp);
-            } 
+                readHttpHeaders(clnt, argsOff ? servRequest + argsOff : "");
+                clnt->filter.count = 0;
+                clnt->filter.hasSince = FALSE;
+            } else if (isGet(method)) {
+                parseGetKeys(clnt, uri, argsOff ? servRequest + argsOff : "");
+            } else {
+                parseStatArgs(clnt, uri, argsOff ? servRequest + argsOff : "");
+            }
+            snprintf(clnt->method, sizeof clnt->method, "%.15s", method);
         }
 
         char *uriStr = uri;
@@ -743,13 +2624,50 @@ handleFrontendRequest(void *arg)
             *strchr(uriStr, '?') = '\0';
         }
 
-        cb = findCallback(clnt, uriStr);
+        if (strcmp(method, "watch") == 0) {
+            cb = findUriEntry(clnt->bep, uriStr) ? watchCallback : NULL;
+        } else if (isGet(method)) {
+            cb = getCallback;
+        } else {
+            cb = findCallback(clnt, uriStr);
+        }
         if (!cb) {
             free(decodedUri);
             clntError(clnt, HTTP_NOTFOUND, uriStr);
+            if (clnt->type == HTTP_CLIENT && clnt->keepAlive) {
+                fflush(clnt->fp);
+                continue;
+            }
             goto end;
         }
+
+        // run the request in its lane - over-rate clients and a full lane
+        // are turned away before any rendering work
+        lane = lane_classify(clnt, cb == fleetCallback ? FLEET_URI : uriStr,
+                             cb == eventsCallback || cb == watchCallback);
+        if (!ratelimit_allow(lane, clnt->addr.sin_addr.s_addr)) {
+            free(decodedUri);
+            clntLimited(clnt);
+            fflush(clnt->fp);
+            // telnet clients keep their connection
+            done = (clnt->type == HTTP_CLIENT && !clnt->keepAlive);
+            continue;
+        }
+        if (lane_enter(lane) != 0) {
+            free(decodedUri);
+            clntBusy(clnt);
+            fflush(clnt->fp);
+            // telnet clients keep their connection, web clients are closed
+            done = (clnt->type == HTTP_CLIENT);
+            continue;
+        }
         done = (*cb)(clnt, decodedUri);
+        end_http_response(clnt);
+        if (clnt->type == HTTP_CLIENT) {
+            // only a response with a known end leaves the connection usable
+            done = !(clnt->keepAlive && clnt->framed);
+        }
+        lane_exit(lane);
         free(decodedUri);
         fflush(clnt->fp);
     }
@@ -758,64 +2676,85 @@ handleFrontendRequest(void *arg)
 end:
     fflush(serv);
     fclose(serv);
+    fclose(in);
     free(clnt);
     return NULL;
 }
 
-static void
-removeOldStats(struct uri_entry *uri_entry)
+static bool_t
+sameValue(struct stats_entry *a, struct stats_entry *b)
 {
-    struct stats_entry *entry;
-    struct stats_entry *tmp;
-
-    entry = TAILQ_FIRST(&uri_entry->stats);
-    while (entry != NULL) {
-        tmp = TAILQ_NEXT(entry, next);
-        free((void *) entry->name);
-        if (entry->type == ALPHA) {
-            free(entry->v.valueStr);
-        }
-        free(entry);
-        entry = tmp;
+    if (a->type != b->type) {
+        return FALSE;
+    }
+    if (a->type == ALPHA) {
+        return strcmp(a->v.valueStr, b->v.valueStr) == 0;
     }
-    TAILQ_INIT(&uri_entry->stats);
+    return a->v.value == b->v.value;
 }
 
-// allocate a stats entry
-struct stats_entry *
-newStatEntry(const char *name, enum stats_type type, char *strVal, uint64_t val)
+// forget the uri's change maps - deltas from before generation are served
+// as every stat
+static void
+resetChanges(struct uri_entry *uri_entry, uint64_t generation)
 {
-    struct stats_entry *entry;
-
-    entry = (struct stats_entry *) calloc(1, sizeof *entry);
-    alloc_fail_check(entry);
+    int i;
 
-    entry->name = name;
-    entry->type = type;
-    switch (type) {
-    case ALPHA:
-        entry->v.valueStr = strVal; // must be allocated externally
-        break;
-    case UINT64:
-        entry->v.value = val;
-        break;
-    default:
-        assert(0);
+    for (i = 0; i < CHANGE_HISTORY; i++) {
+        free(uri_entry->changes[i].bits);
+        uri_entry->changes[i].bits = NULL;
+        uri_entry->changes[i].generation = 0;
     }
-    return entry;
+    uri_entry->changeNext = 0;
+    uri_entry->changedFrom = generation;
 }
 
-// add new stats to the uri
+// note which of the uri's stats the pending ones change, slot by slot in
+// reply order, before they are swapped in (under wrlock). A publish that
+// adds, drops or renames stats starts the change maps afresh.
 static void
-addNewStats(struct uri_entry *uri_entry, struct stats_entries *new_stats)
+trackChanges(struct uri_entry *uri_entry, uint64_t generation)
 {
-    struct stats_entry *entry;
+    struct change_map     *map = &uri_entry->changes[uri_entry->changeNext];
+    struct stats_snapshot *old = uri_entry->stats;
+    struct stats_snapshot *cur = uri_entry->pending;
+    uint64_t              *bits;
+    int                   i;
+
+    bits = (uint64_t *) calloc((old->count + 63) / 64 + 1, sizeof *bits);
+    alloc_fail_check(bits);
+    for (i = 0; i < cur->count && i < old->count; i++) {
+        if (cur->entries[i].id != old->entries[i].id) {
+            break;
+        }
+        if (!sameValue(&cur->entries[i], &old->entries[i])) {
+            bits[i / 64] |= 1ULL << (i % 64);
+        }
+    }
+    if (i != cur->count || i != old->count) {
+        free(bits);
+        resetChanges(uri_entry, generation);
+        return;
+    }
 
-    while (!TAILQ_EMPTY(new_stats)) {
-        entry = TAILQ_FIRST(new_stats);
-        TAILQ_REMOVE(new_stats, entry, next);
-        TAILQ_INSERT_TAIL(&uri_entry->stats, entry, next);
+    // the oldest map drops out - its changes are no longer known
+    if (map->bits != NULL) {
+        free(map->bits);
+        uri_entry->changedFrom = map->generation;
     }
+    map->generation = generation;
+    map->bits = bits;
+    uri_entry->changeNext = (uri_entry->changeNext + 1) % CHANGE_HISTORY;
+}
+
+// lay out the builder's stats as the uri's pending snapshot - only the
+// poller touches the pending snapshot, so no lock is needed
+void
+stageStats(struct uri_entry *uri_entry, struct stats_builder *b)
+{
+    free(uri_entry->pending);
+    uri_entry->pending = stats_finish(b, GENERAL_URI(uri_entry));
+    uri_entry->staged = TRUE;
 }
 
 static int
@@ -825,9 +2764,11 @@ checkAndConnect(backend_t *bep)
     int err = 0;
     int retries = 5;
 
-    // try to connect
+    // try to connect - a restored snapshot is served meanwhile
     wrlock(bep);
-    bep->state = CONNECTING;
+    if (!bep->warm) {
+        bep->state = CONNECTING;
+    }
     unlock(bep);
     for (i = 0; i <= retries; i++) {
         if (!sp_memcache_is_connected(bep)) {
@@ -838,6 +2779,13 @@ checkAndConnect(backend_t *bep)
             sleep(CONN_RETRY_WAIT);
         }
     }
+    if (err != 0 && bep->warm) {
+        // the restored snapshot can't be brought up to date
+        wrlock(bep);
+        bep->warm = FALSE;
+        bep->state = CONNECTING;
+        unlock(bep);
+    }
     return err;
 }
 
@@ -847,55 +2795,103 @@ getStat(struct uri_entry *uri_entry, backend_t *bep)
 {
     int err = 0;
     char statsCmd[CMDSZ];
+    uint64_t start = monotonic_us();
 
     snprintf(statsCmd, sizeof statsCmd, "stats %s\r\n", uri_entry->uri);
     err = sp_memcache_write(bep, statsCmd);
 
-    struct stats_entries new_stats;
-    TAILQ_INIT(&new_stats);
-
     if (err == 0) {
+        bool_t unchanged;
+
         // parse command results
-        err = sp_memcache_read_replies(bep, &new_stats);
+        err = sp_memcache_read_replies(bep, &bep->builder,
+                                       &uri_entry->fingerprint, &unchanged);
+        if (err == 0) {
+            latency_record(bep->latency, LATENCY_POLL, monotonic_us() - start);
+        } else {
+            uri_entry->fingerprint = 0;
+        }
+
+        // the same reply as last time only needs its timestamp bumped
+        if (err == 0 && unchanged) {
+            uri_entry->unchanged = TRUE;
+            return;
+        }
 
         // update stats with new ones - (or nuke old ones on error)
-        wrlock(bep);
-        removeOldStats(uri_entry);
-        addNewStats(uri_entry, &new_stats);
-        unlock(bep);
+        stageStats(uri_entry, &bep->builder);
+    }
+}
+
+// one step of the health probe: send the command and read back a reply as
+// long as the expected one, timing the round trip on the monotonic clock.
+// Returns 0 when the reply is the expected one.
+static int
+probeStep(backend_t *bep, const char *cmd, const char *expect, uint64_t *us)
+{
+    int                err = 0;
+    int                done = 0;
+    int                len = strlen(expect);
+    uint64_t           start;
+    char               *reply;
+    struct sp_memcache_socket_state session_info;
+
+    memset(&session_info, 0, sizeof session_info);
+    gettimeofday(&session_info.start_time, NULL);
+    session_info.timeout =  session_info.time_remaining = bep->settings.read_ms;
+
+    reply = (char *) calloc(1, len + 1);
+    alloc_fail_check(reply);
+
+    start = monotonic_us();
+    err = sp_memcache_write(bep, cmd);
+    if (err == 0) {
+        err = sp_memcache_read(bep, reply, len, &session_info, &done);
+    }
+    *us = monotonic_us() - start;
+
+    if (err == 0 && memcmp(reply, expect, len) != 0) {
+        // didn't get expected answer
+        err = EPROTO;
     }
+    free(reply);
+    return err;
 }
 
-// get health information - used for liveness checks etc
-#define LIVENESS_CMD "set __LIVENESS__ 0 0 12\r\nliveness chk\r\n"
-#define LIVENESS_OK  "STORED\r\n"
+// get health information - used for liveness checks etc.  The probe sets
+// the proxy's health key to a fresh value, reads it back and checks it, then
+// deletes it, timing each step in microseconds.
+enum probe_step { PROBE_SET, PROBE_GET, PROBE_DELETE, NUM_PROBE_STEPS };
+
+static const char *probeNames[NUM_PROBE_STEPS] = { "set", "get", "delete" };
+static const enum latency_metric probeMetrics[NUM_PROBE_STEPS] = {
+    LATENCY_SET, LATENCY_GET, LATENCY_DELETE
+};
 
 static void
 getHealth(struct uri_entry *uri_entry, backend_t *bep)
 {
-    int                done = 0;
     int                err = 0;
+    int                step;
+    int                i;
+    int                size = bep->settings.health_value_size;
+    const char         *key = bep->settings.health_key;
     time_t             now;
-    int64_t            livenessDelta = 0;
-    uint64_t           start;
     uint64_t           pollDelta = 0;
     uint64_t           livenessVal = 0;
-    char               *polltimeBuf;
-    char               healthCmd[CMDSZ];
-    struct stats_entry *liveness;
-    struct stats_entry *lastpoll;
-    struct stats_entry *lastpoll_int;
-    struct stats_entry *liveness_resp;
-    struct sp_memcache_socket_state session_info;
+    uint64_t           probeUs = 0;
+    uint64_t           stepUs[NUM_PROBE_STEPS];
+    char               polltimeBuf[DATEBUFSZ];
+    char               *value;
+    char               *cmd;
+    char               *expect;
+    char               name[CMDSZ];
+    struct stats_builder *b = &bep->builder;
 
-    memset(&session_info, 0, sizeof session_info);
-    gettimeofday(&session_info.start_time, NULL);
-    session_info.timeout =  session_info.time_remaining = bep->settings.read_ms;
+    memset(stepUs, 0, sizeof stepUs);
 
     // pull the last polltime
     time(&now);
-    polltimeBuf = (char *) calloc(1, DATEBUFSZ);
-    alloc_fail_check(polltimeBuf);
     ctime_r(&now, polltimeBuf);
     polltimeBuf[strlen(polltimeBuf) - 1] = '\0'; // zap newline
 
@@ -905,52 +2901,160 @@ getHealth(struct uri_entry *uri_entry, backend_t *bep)
         pollDelta = 0;
     }
 
-    // do a liveness check
-    snprintf(healthCmd, sizeof healthCmd, LIVENESS_CMD);
-    start = timestamp();
-    err = sp_memcache_write(bep, healthCmd);
-    if (err != 0) {
-        goto fail;
+    // a value that differs from one probe to the next, so a stale item
+    // can't pass for this one
+    value = (char *) malloc(size + 1);
+    alloc_fail_check(value);
+    for (i = 0; i < size; i++) {
+        value[i] = 'a' + (bep->probes + i) % 26;
     }
+    value[size] = '\0';
+    bep->probes++;
+
+    cmd = (char *) malloc(size + MAX_HEALTH_KEY + CMDSZ);
+    alloc_fail_check(cmd);
+    expect = (char *) malloc(size + MAX_HEALTH_KEY + CMDSZ);
+    alloc_fail_check(expect);
+
+    for (step = 0; step < NUM_PROBE_STEPS; step++) {
+        switch (step) {
+        case PROBE_SET:
+            sprintf(cmd, "set %s 0 %d %d\r\n%s\r\n", key, HEALTH_EXPTIME,
+                    size, value);
+            sprintf(expect, "STORED\r\n");
+            break;
+        case PROBE_GET:
+            sprintf(cmd, "get %s\r\n", key);
+            sprintf(expect, "VALUE %s 0 %d\r\n%s\r\nEND\r\n", key, size,
+                    value);
+            break;
+        case PROBE_DELETE:
+            sprintf(cmd, "delete %s\r\n", key);
+            sprintf(expect, "DELETED\r\n");
+            break;
+        }
+        err = probeStep(bep, cmd, expect, &stepUs[step]);
+        if (err != 0) {
+            break;
+        }
+        probeUs += stepUs[step];
+        latency_record(bep->latency, probeMetrics[step], stepUs[step]);
+    }
+    free(value);
+    free(cmd);
+    free(expect);
 
-    // expect "STORED\r\n" or "ERROR\r\n" or timeout/fail
-    memset(healthCmd, 0, CMDSZ);
-    err = sp_memcache_read(bep, healthCmd, strlen(LIVENESS_OK),
-                           &session_info, &done);
-
-    livenessDelta = timestamp() - start;
-
-    // livenessDelta cannot be negative.
-    //
-    livenessDelta = (livenessDelta < 0) ? 0 : livenessDelta;
+    if (err == 0) {
+        // things are ok - mark as such in the stats
+        livenessVal = 1;
+        latency_record(bep->latency, LATENCY_LIVENESS, probeUs);
+    } else {
+        // the connection may be left mid reply - start the next uri afresh
+        sp_memcache_disconnect(bep);
+    }
 
-    if (err != 0) {
-        goto fail;
+    stats_add(b, "statsAge", UINT64, NULL, pollDelta);
+    stats_add(b, "lastpoll", ALPHA, polltimeBuf, 0);
+    stats_add(b, "liveness", UINT64, NULL, livenessVal);
+    stats_add(b, "respTimeMs", UINT64, NULL, (probeUs + 500) / 1000);
+    if (err == 0) {
+        snprintf(name, sizeof name, "ok");
+    } else {
+        snprintf(name, sizeof name, "%s failed", probeNames[step]);
     }
-    if (strcmp(healthCmd, LIVENESS_OK) != 0) {
-        // didn't get expected answer
-        goto fail;
+    stats_add(b, "probe", ALPHA, name, 0);
+
+    // the last probe's steps and their percentiles over recent minutes
+    for (step = 0; step < NUM_PROBE_STEPS; step++) {
+        struct sketch sk;
+
+        snprintf(name, sizeof name, "%sUs", probeNames[step]);
+        stats_add(b, name, UINT64, NULL, stepUs[step]);
+
+        sketch_init(&sk);
+        latency_merge(bep->latency, probeMetrics[step],
+                      DEFAULT_LATENCY_MINUTES, &sk);
+        for (i = 0; i < NUM_QUANTILES; i++) {
+            snprintf(name, sizeof name, "%sUs:%s", probeNames[step],
+                     quantileNames[i]);
+            stats_add(b, name, UINT64, NULL, (uint64_t)
+                      (sketch_quantile(&sk, latencyQuantiles[i]) + 0.5));
+        }
+        sketch_free(&sk);
     }
+    stageStats(uri_entry, b);
+}
+
+// publish the poll cycle - every staged uri is swapped in under one short
+// write lock, so readers always see all uris from the same cycle, and the
+// stream subscribers are woken up
+void
+publishCycle(backend_t *bep)
+{
+    struct uri_entry *uri_entry;
+    uint64_t         now = timestamp();
 
-    // things are ok - mark as such in the stats
-    livenessVal = 1;
-        
-fail:
-    liveness = newStatEntry(strdup("liveness"), UINT64, NULL, livenessVal);
-    liveness_resp = newStatEntry(strdup("respTimeMs"), UINT64, NULL,
-                                 livenessDelta);
-    lastpoll_int = newStatEntry(strdup("statsAge"), UINT64, NULL, pollDelta);
-    lastpoll = newStatEntry(strdup("lastpoll"), ALPHA, polltimeBuf, 0);
     wrlock(bep);
-    removeOldStats(uri_entry);
-    TAILQ_INSERT_TAIL(&uri_entry->stats, lastpoll_int, next);
-    TAILQ_INSERT_TAIL(&uri_entry->stats, lastpoll, next);
-    TAILQ_INSERT_TAIL(&uri_entry->stats, liveness, next);
-    TAILQ_INSERT_TAIL(&uri_entry->stats, liveness_resp, next);
+    TAILQ_FOREACH(uri_entry, &bep->uris, next) {
+        if (uri_entry->unchanged) {
+            // the stats stand - no swap, same generation, fresh timestamp
+            uri_entry->published_ms = now;
+            uri_entry->unchanged = FALSE;
+        }
+        if (!uri_entry->staged) {
+            continue;
+        }
+        trackChanges(uri_entry, bep->generation + 1);
+        free(uri_entry->stats);
+        uri_entry->stats = uri_entry->pending;
+        uri_entry->pending = NULL;
+        uri_entry->generation = bep->generation + 1;
+        uri_entry->published_ms = now;
+        uri_entry->staged = FALSE;
+    }
+    top_update(bep, now);
+    history_update(bep, now);
+    analysis_update(bep, now);
+    bep->warm = FALSE;
+    pthread_mutex_lock(&bep->genLock);
+    bep->generation++;
+    pthread_cond_broadcast(&bep->genCond);
+    pthread_mutex_unlock(&bep->genLock);
     unlock(bep);
 }
 
-// memcache server poller
+void
+restoreStats(struct uri_entry *uri_entry, struct stats_builder *b,
+             uint64_t generation, uint64_t published_ms)
+{
+    free(uri_entry->stats);
+    uri_entry->stats = stats_finish(b, GENERAL_URI(uri_entry));
+    resetChanges(uri_entry, generation);
+    uri_entry->generation = generation;
+    uri_entry->published_ms = published_ms;
+}
+
+// a uri's poll interval: its own if configured, else the backend's,
+// stretched for uris whose stats are expensive to produce
+static int
+pollInterval(struct uri_entry *uri_entry, backend_t *bep)
+{
+    uint64_t interval = bep->settings.pollfreq_ms;
+    uint64_t costly = uri_entry->cost_us * POLL_COST_SHARE / 1000;
+
+    if (uri_entry->pollfreq_ms != 0) {
+        return uri_entry->pollfreq_ms;
+    }
+    if (costly > interval) {
+        interval = (costly < interval * POLL_MAX_STRETCH) ? costly :
+                   interval * POLL_MAX_STRETCH;
+    }
+    return (int) interval;
+}
+
+// memcache server poller - each uri is polled when it comes due on the
+// monotonic clock, and the uris polled together are published as one cycle.
+// The timer wheel wakes the poller for the next due uri.
 static void *
 runBackend(void *arg)
 {
@@ -958,23 +3062,38 @@ runBackend(void *arg)
     bool_t done = FALSE;
 
     uint64_t now;
-    uint64_t then;
-    int64_t delta;
-    int64_t sleep_time;
+    uint64_t start;
+    uint64_t cost;
+    uint64_t next;
+    int      longest;
+    bool_t   polled;
+    struct uri_entry *uri_entry;
 
     wrlock(bep);
-    bep->state = HALTED;
+    if (!bep->warm) {
+        bep->state = HALTED;
+    }
     unlock(bep);
 
+    // the first polls already keep to the backend's phase, so the backends
+    // don't all poll at once on startup or a reconfigure
+    now = wheel_now();
+    TAILQ_FOREACH(uri_entry, &bep->uris, next) {
+        uri_entry->due_ms = now + bep->phase_ms;
+    }
+
 restart:
     while (!done) {
 
-        // poll for each of the configured uri
-        struct uri_entry *uri_entry;
-
-        then = timestamp();
+        // poll each of the configured uris that is due
+        polled = FALSE;
+        now = wheel_now();
         TAILQ_FOREACH(uri_entry, &bep->uris, next) {
 
+            if (uri_entry->due_ms > now) {
+                continue;
+            }
+
             if (checkAndConnect(bep) != 0) {
                 goto restart;
             }
@@ -983,6 +3102,7 @@ restart:
             bep->state = POLLING;
             unlock(bep);
 
+            start = monotonic_us();
             if (strcmp(uri_entry->uri, "health") == 0) {
                 // synthetic "health" stats entry
                 getHealth(uri_entry, bep);
@@ -990,28 +3110,46 @@ restart:
                 // request this stats uri
                 getStat(uri_entry, bep);
             }
-
+            cost = monotonic_us() - start;
+
+            uri_entry->cost_us = (uri_entry->cost_us == 0) ? cost :
+                (uri_entry->cost_us * (POLL_COST_WEIGHT - 1) + cost) /
+                POLL_COST_WEIGHT;
+            uri_entry->interval_ms = pollInterval(uri_entry, bep);
+            uri_entry->due_ms += uri_entry->interval_ms;
+            if (uri_entry->due_ms <= now) {
+                // fell behind - skip the missed polls
+                uri_entry->due_ms = now + uri_entry->interval_ms;
+            }
             uri_entry->lastpoll = time(0);
+            polled = TRUE;
         }
         sp_memcache_disconnect(bep);
-        now = timestamp();
 
-        delta = now - then;
-
-        // take care of time going backwards
-        //
-        delta = (delta < 0) ? 0 : delta;
-
-        sleep_time =  bep->settings.pollfreq_ms - delta;
+        if (polled) {
+            publishCycle(bep);
+        }
 
-        // if sleep_time is negative then sleep for 500ms
-        // else sleep for the whole sleep_time duration.
-        //
-        sleep_time = (sleep_time < 0) ? 500 : sleep_time;
+        // sleep until the next uri is due, or a poll interval when there
+        // is none
+        next = wheel_now() + bep->settings.pollfreq_ms;
+        longest = bep->settings.pollfreq_ms;
+        TAILQ_FOREACH(uri_entry, &bep->uris, next) {
+            if (uri_entry->due_ms < next) {
+                next = uri_entry->due_ms;
+            }
+            if (uri_entry->interval_ms > longest) {
+                longest = uri_entry->interval_ms;
+            }
+        }
+        wrlock(bep);
+        bep->longest_ms = longest;
+        unlock(bep);
 
-        // wait for next poll
+        // wait for next poll, and note how late it fires
         //
-        usleep(sleep_time * 1000);
+        latency_record(bep->latency, LATENCY_DRIFT,
+                       wheel_sleep(&bep->timer, next));
     }
     wrlock(bep);
     bep->state = HALTED;
@@ -1033,12 +3171,17 @@ backend_new(global_statsproxy_settings_t *global_settings,
     struct sockaddr_in   back;
     pthread_rwlockattr_t attr;
     backend_t            *bep = NULL;
+    char                 phaseKey[2 * HOSTSZ + CMDSZ];
+    uint64_t             spread;
 
     memset(&front, 0, sizeof front);
     memset(&back, 0, sizeof back);
 
-    err = host2addr(local_settings->backhost, &back);
-    bail_error_msg(err, "lookup fail for %s", local_settings->backhost);
+    // clusters have no backend of their own
+    if (local_settings->backport != 0) {
+        err = host2addr(local_settings->backhost, &back);
+        bail_error_msg(err, "lookup fail for %s", local_settings->backhost);
+    }
 
     err = host2addr(local_settings->fronthost, &front);
     bail_error_msg(err, "lookup fail for %s", local_settings->fronthost);
@@ -1050,11 +3193,45 @@ backend_new(global_statsproxy_settings_t *global_settings,
     alloc_fail_check(bep->settings.fronthost);
     bep->settings.frontaddr   = front.sin_addr.s_addr;
     bep->settings.frontport   = local_settings->frontport;
-    bep->settings.backhost    = strdup(local_settings->backhost);
+    bep->settings.backhost    = strdup(local_settings->backport != 0 ?
+                                       local_settings->backhost : "cluster");
     alloc_fail_check(bep->settings.backhost);
     bep->settings.backaddr    = back.sin_addr.s_addr;
     bep->settings.backport    = local_settings->backport;
+    if (local_settings->pool != NULL) {
+        bep->settings.pool    = strdup(local_settings->pool);
+        alloc_fail_check(bep->settings.pool);
+    }
+    // the health probe key defaults to one of this proxy's own, so that
+    // proxies watching the same memcached don't race on it
+    if (local_settings->health_key != NULL) {
+        bep->settings.health_key = strdup(local_settings->health_key);
+    } else {
+        char hostname[HOSTSZ];
+        char key[MAX_HEALTH_KEY + 1];
+
+        memset(hostname, 0, sizeof hostname);
+        gethostname(hostname, HOSTSZ - 1);
+        snprintf(key, sizeof key, "%s:%.200s:%u", HEALTH_KEY_PREFIX,
+                 hostname, local_settings->frontport);
+        bep->settings.health_key = strdup(key);
+    }
+    alloc_fail_check(bep->settings.health_key);
+    bep->settings.health_value_size = local_settings->health_value_size != 0 ?
+        local_settings->health_value_size : DEFAULT_HEALTH_VALUE_SIZE;
     bep->settings.pollfreq_ms = LOCAL_OR_GLOBAL(pollfreq_ms);
+    bep->settings.poll_jitter = local_settings->poll_jitter;
+    bep->longest_ms = bep->settings.pollfreq_ms;
+
+    // spread the backends' polls over a share of the poll interval, each
+    // at a phase fixed by its addresses so restarts keep the spread
+    snprintf(phaseKey, sizeof phaseKey, "%s:%u/%s:%u",
+             local_settings->fronthost, local_settings->frontport,
+             bep->settings.backhost, local_settings->backport);
+    spread = (uint64_t) bep->settings.pollfreq_ms *
+             (uint64_t) bep->settings.poll_jitter / 100;
+    bep->phase_ms = (int) (fnv1a(phaseKey, strlen(phaseKey)) % (spread + 1));
+    timer_init(&bep->timer);
 
     bep->settings.refreshfreq_ms = LOCAL_OR_GLOBAL(refreshfreq_ms);
 
@@ -1063,6 +3240,8 @@ backend_new(global_statsproxy_settings_t *global_settings,
     bep->settings.write_ms    = LOCAL_OR_GLOBAL(write_ms);
     bep->fd          = -1;
     bep->state       = HALTED;
+    bep->slot        = -1;
+    bep->latency     = latency_new();
 
     /* memcache reporter settings. */
     if (local_settings->reporter != NULL) {
@@ -1075,6 +3254,8 @@ backend_new(global_statsproxy_settings_t *global_settings,
 
     pthread_rwlockattr_init(&attr);
     pthread_rwlock_init(&bep->rwlock, &attr);
+    pthread_mutex_init(&bep->genLock, NULL);
+    pthread_cond_init(&bep->genCond, NULL);
     TAILQ_INIT(&bep->uris);
 bail:
     return bep;
@@ -1111,13 +3292,18 @@ static void
 startBackendServer(backend_t *bep)
 {
     pthread_t chld_thr;
-    pthread_create(&chld_thr, NULL, runBackend, (void *) bep);
+    if (bep->cluster != NULL) {
+        pthread_create(&chld_thr, NULL, cluster_run, (void *) bep->cluster);
+    } else {
+        pthread_create(&chld_thr, NULL, runBackend, (void *) bep);
+    }
     pthread_detach(chld_thr);
 }
 
 // add a uri to the system config
 static void
-addSystemUri(system_statsproxy_settings_t *sys, const char *uri, callback_t cb)
+addSystemUri(system_statsproxy_settings_t *sys, const char *uri, callback_t cb,
+             enum lane_type lane)
 {
     struct confed_uri *u;
     u = (struct confed_uri *) calloc(1, sizeof *u);
@@ -1125,12 +3311,14 @@ addSystemUri(system_statsproxy_settings_t *sys, const char *uri, callback_t cb)
     u->uri = strdup(uri);
     alloc_fail_check(u->uri);
     u->cb = cb;
+    u->lane = lane;
     TAILQ_INSERT_TAIL(&sys->uris, u, next);
 }
 
-// add a uri to the global config
+// add a uri to the global config (polled every pollfreq_ms, or 0 for the
+// backend's interval)
 void
-addGlobalUri(global_statsproxy_settings_t *global, char *uri)
+addGlobalUri(global_statsproxy_settings_t *global, char *uri, int pollfreq_ms)
 {
     struct confed_uri *u;
     u = (struct confed_uri *) calloc(1, sizeof *u);
@@ -1138,12 +3326,14 @@ addGlobalUri(global_statsproxy_settings_t *global, char *uri)
     u->uri = strdup(uri);
     alloc_fail_check(u->uri);
     u->cb = statsCallback;
+    u->lane = LANE_HTML;
+    u->pollfreq_ms = pollfreq_ms;
     TAILQ_INSERT_TAIL(&global->uris, u, next);
 }
 
 // add a uri to the local config
 void
-addLocalUri(local_statsproxy_settings_t *local, char *uri)
+addLocalUri(local_statsproxy_settings_t *local, char *uri, int pollfreq_ms)
 {
     struct confed_uri *u;
     u = (struct confed_uri *) calloc(1, sizeof *u);
@@ -1151,28 +3341,36 @@ addLocalUri(local_statsproxy_settings_t *local, char *uri)
     u->uri = strdup(uri);
     alloc_fail_check(u->uri);
     u->cb = statsCallback;
+    u->lane = LANE_HTML;
+    u->pollfreq_ms = pollfreq_ms;
     TAILQ_INSERT_TAIL(&local->uris, u, next);
 }
 
 static void
 addSystemUris(system_statsproxy_settings_t *sys)
 {
-    addSystemUri(sys, "reporter", reporterCallback);
-    addSystemUri(sys, "top-keys", reporterCallback);
-    addSystemUri(sys, "top-keys-gets", reporterCallback);
-    addSystemUri(sys, "top-keys-sets", reporterCallback);
-    addSystemUri(sys, "top-keys-all", reporterCallback);
-    addSystemUri(sys, "top-keys-select", reporterCallback);
-    addSystemUri(sys, "top-clients-key", reporterCallback);
-    addSystemUri(sys, "top-clients-ops", reporterCallback);
-    addSystemUri(sys, "mcr-config", reporterCallback);
-    addSystemUri(sys, "mcr-enable", reporterCallback);
-    addSystemUri(sys, "mcr-disable", reporterCallback);
-    addSystemUri(sys, "logo.png", imageCallback);
+    addSystemUri(sys, "reporter", reporterCallback, LANE_HEAVY);
+    addSystemUri(sys, "top-keys", reporterCallback, LANE_HEAVY);
+    addSystemUri(sys, "top-keys-gets", reporterCallback, LANE_HEAVY);
+    addSystemUri(sys, "top-keys-sets", reporterCallback, LANE_HEAVY);
+    addSystemUri(sys, "top-keys-all", reporterCallback, LANE_HEAVY);
+    addSystemUri(sys, "top-keys-select", reporterCallback, LANE_HEAVY);
+    addSystemUri(sys, "top-clients-key", reporterCallback, LANE_HEAVY);
+    addSystemUri(sys, "top-clients-ops", reporterCallback, LANE_HEAVY);
+    addSystemUri(sys, "mcr-config", reporterCallback, LANE_HEAVY);
+    addSystemUri(sys, "mcr-enable", reporterCallback, LANE_HEAVY);
+    addSystemUri(sys, "mcr-disable", reporterCallback, LANE_HEAVY);
+    addSystemUri(sys, "logo.png", imageCallback, LANE_HTML);
+    addSystemUri(sys, ALL_URI, allCallback, LANE_HTML);
+    addSystemUri(sys, FLEET_URI, fleetCallback, LANE_HEAVY);
+    addSystemUri(sys, TOP_URI, topCallback, LANE_HTML);
+    addSystemUri(sys, LATENCY_URI, latencyCallback, LANE_HTML);
+    addSystemUri(sys, HISTORY_URI, historyCallback, LANE_HTML);
+    addSystemUri(sys, SLAB_ANALYSIS_URI, slabAnalysisCallback, LANE_HTML);
 }
 
-void
-addProxy(struct settings *settings)
+static backend_t *
+newProxy(struct settings *settings)
 {
     backend_t *bep;
     struct confed_uri *confed_uri_entry;
@@ -1188,24 +3386,42 @@ addProxy(struct settings *settings)
     TAILQ_FOREACH(confed_uri_entry, &settings->local.uris, next) {
         entry = (struct uri_entry *) calloc(1, sizeof *entry);
         alloc_fail_check(entry);
-        TAILQ_INIT(&entry->stats);
+        entry->stats = stats_finish(&bep->builder, FALSE);
         entry->uri = strdup(confed_uri_entry->uri);
         alloc_fail_check(entry->uri);
         entry->cb = confed_uri_entry->cb;
+        entry->pollfreq_ms = confed_uri_entry->pollfreq_ms;
         TAILQ_INSERT_TAIL(&bep->uris, entry, next);
     }
     TAILQ_FOREACH(confed_uri_entry, &settings->global.uris, next) {
         entry = (struct uri_entry *) calloc(1, sizeof *entry);
         alloc_fail_check(entry);
-        TAILQ_INIT(&entry->stats);
+        entry->stats = stats_finish(&bep->builder, FALSE);
         entry->uri = strdup(confed_uri_entry->uri);
         alloc_fail_check(entry->uri);
         entry->cb = confed_uri_entry->cb;
+        entry->pollfreq_ms = confed_uri_entry->pollfreq_ms;
         TAILQ_INSERT_TAIL(&bep->uris, entry, next);
     }
     bep->config = settings;
+    return bep;
+}
+
+void
+addProxy(struct settings *settings)
+{
+    backend_t *bep = newProxy(settings);
+
     TAILQ_INSERT_TAIL(&settings->proxies, bep, next);
+}
 
+// a virtual backend serving the aggregate stats of a pool of backends
+void
+addCluster(struct settings *settings)
+{
+    backend_t *bep = newProxy(settings);
+
+    TAILQ_INSERT_TAIL(&settings->clusters, bep, next);
 }
 
 // start frontend and backend servers
@@ -1216,14 +3432,29 @@ startProxies(struct settings *settings)
     backend_t                *bep;
     struct uri_entry         *entry;
 
+    top_init(proxies);
+    if (settings->sys.history_hours > 0) {
+        TAILQ_FOREACH(bep, proxies, next) {
+            bep->history = history_new(settings->sys.history_hours * 3600);
+        }
+        TAILQ_FOREACH(bep, &settings->clusters, next) {
+            bep->history = history_new(settings->sys.history_hours * 3600);
+        }
+    }
+
+    // pick up the snapshots and history the last run left behind
+    if (settings->sys.state_file != NULL) {
+        state_restore(settings);
+    }
+
     TAILQ_FOREACH(bep, proxies, next) {
         proxylog(LOG_INFO, "%s:%d -> %s:%d",
                 bep->settings.fronthost,
                 bep->settings.frontport,
                 bep->settings.backhost,
                 bep->settings.backport);
-        proxylog(LOG_INFO, "polling interval: %dms",
-                bep->settings.pollfreq_ms);
+        proxylog(LOG_INFO, "polling interval: %dms (phase %dms)",
+                bep->settings.pollfreq_ms, bep->phase_ms);
         proxylog(LOG_INFO, "webpage refresh interval: %dms",
                 bep->settings.refreshfreq_ms);
         proxylog(LOG_INFO, "connect/read/write: %d/%d/%dms",
@@ -1231,25 +3462,44 @@ startProxies(struct settings *settings)
                 bep->settings.read_ms,
                 bep->settings.write_ms);
         TAILQ_FOREACH(entry, &bep->uris, next) {
-            proxylog(LOG_INFO, "    uri: %s", entry->uri);
+            if (entry->pollfreq_ms != 0) {
+                proxylog(LOG_INFO, "    uri: %s (every %dms)", entry->uri,
+                         entry->pollfreq_ms);
+            } else {
+                proxylog(LOG_INFO, "    uri: %s", entry->uri);
+            }
         }
         startBackendServer(bep);
         startFrontendServer(bep);
     }
-}
 
-// ext for reconfigure
-static void hup_handler(int sig)
-{
-    _exit(EXIT_RECONFIGURE);
+    // clusters start once all of their members are known
+    TAILQ_FOREACH(bep, &settings->clusters, next) {
+        bep->cluster = cluster_new(bep, proxies);
+        proxylog(LOG_INFO, "%s:%d -> cluster of pool %s",
+                bep->settings.fronthost,
+                bep->settings.frontport,
+                bep->settings.pool != NULL ? bep->settings.pool : "(all)");
+        startBackendServer(bep);
+        startFrontendServer(bep);
+    }
+
+    if (settings->sys.state_file != NULL) {
+        state_start(settings);
+    }
 }
 
 // initialize the service
 static void
 statsproxy_init(void)
 {
-    // will have a fancier reconfig handler later
-    signal(SIGHUP, hup_handler);
+    sigset_t hup;
+
+    // SIGHUP (reconfigure) is taken by main alone, see below
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+    schema_check();
     // don't let disconnects ruin the party
     signal(SIGPIPE, SIG_IGN);
 }
@@ -1300,6 +3550,8 @@ int
 main(int argc, char **argv) 
 {
     int                rc;
+    int                sig;
+    sigset_t           hup;
     struct settings    settings;
 
     if (argc != 3 || strcmp(argv[1], "-F") != 0) {
@@ -1317,10 +3569,13 @@ main(int argc, char **argv)
     TAILQ_INIT(&settings.global.uris);
     TAILQ_INIT(&settings.local.uris);
     TAILQ_INIT(&settings.proxies);
+    TAILQ_INIT(&settings.clusters);
 
     addSystemUris(&settings.sys);
+    lanes_init(&settings.sys);
     settings.sys.reporterAddr = strdup("127.0.0.1");
     settings.sys.reporterPort = 23357;
+    settings.sys.history_hours = DEFAULT_HISTORY_HOURS;
 
     char *filename = argv[2];
     FILE *fp;
@@ -1340,11 +3595,18 @@ main(int argc, char **argv)
 
     startProxies(&settings);
 
-    pause();
+    // wait for a reconfigure; the state is saved first, so the proxy
+    // restarted with the new config picks up where this one left off
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    sigwait(&hup, &sig);
+    if (settings.sys.state_file != NULL) {
+        state_save(&settings, TRUE);
+    }
 
     // Close syslog.
     //
     closelog();
 
-    exit (0);
+    _exit(EXIT_RECONFIGURE);
 }
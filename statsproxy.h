@@ -48,6 +48,9 @@
 #ifndef _STATSPROXY_H
 #define _STATSPROXY_H
 
+#include "schema.h"
+#include "wheel.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -72,18 +75,87 @@ extern "C" {
 //
 #define DEFAULT_POLL_FREQ_MS 5000
 
+// a uri without a poll-interval of its own is polled no more often than
+// POLL_COST_SHARE times its (averaged) round trip, so that expensive stats
+// commands back off, but at least every POLL_MAX_STRETCH poll intervals.
+// The round trip average weighs each poll 1/POLL_COST_WEIGHT.
+//
+#define POLL_COST_SHARE  50
+#define POLL_MAX_STRETCH 12
+#define POLL_COST_WEIGHT 8
+
+// the longest poll-interval (seconds) a backend or uri can be given
+//
+#define MAX_POLL_INTERVAL (24 * 3600)
+
+// default spread of a backend's poll phase, in percent of its poll
+// interval, so that the backends don't all poll at once
+//
+#define DEFAULT_POLL_JITTER 100
+
 //default webpage refresh frequency
 //
 #define DEFAULT_WEBPAGE_REFRESH_FREQ_MS 15000
 
+// default request lane limits - concurrent requests per lane and the
+// longest a request waits for a free slot before it is turned away
+//
+#define DEFAULT_RAW_LANE_LIMIT   64
+#define DEFAULT_HTML_LANE_LIMIT  8
+#define DEFAULT_HEAVY_LANE_LIMIT 2
+#define DEFAULT_STREAM_LANE_LIMIT 32
+#define DEFAULT_LANE_QUEUE_MS    5000
+#define MAX_LANE_BURST           100000
+
+// stream subscribers get a keepalive when nothing was polled for this long
+//
+#define STREAM_KEEPALIVE_MS      15000
+
+// health probe defaults - the value size, the largest value allowed, the
+// expiry of the probe item and the prefix of the per-proxy default key
+//
+#define DEFAULT_HEALTH_VALUE_SIZE 64
+#define MAX_HEALTH_VALUE_SIZE     (512 * 1024)
+#define HEALTH_EXPTIME            60
+#define HEALTH_KEY_PREFIX         "__statsproxy_health__"
+#define MAX_HEALTH_KEY            250
+
 // proxy server callback function
 typedef int (*callback_t)(void *arg, char *uri);
 
+// request execution lanes
+enum lane_type { LANE_RAW, LANE_HTML, LANE_HEAVY, LANE_STREAM, NUM_LANES };
+
 // one uri in the config
 struct confed_uri {
     TAILQ_ENTRY(confed_uri)      next;
     char                         *uri;        // uri
     callback_t                   cb;         // callback for this uri
+    enum lane_type               lane;       // lane for http requests
+    int                          pollfreq_ms; // own poll interval (or 0)
+};
+
+// one request execution lane - telnet scrapers, html pages and heavy
+// reporter pages each run under their own concurrency limit
+struct lane {
+    const char                   *name;       // config name
+    enum lane_type               type;        // lane type
+    int                          limit;       // max concurrent requests
+    int                          queue_ms;    // max wait for a free slot
+    int                          rate;        // per client requests/sec
+    int                          burst;       // per client burst size
+    int                          active;      // requests running now
+    uint64_t                     rejected;    // requests turned away
+    uint64_t                     limited;     // requests over the rate
+    pthread_mutex_t              lock;
+    pthread_cond_t               cv;
+};
+
+// config override placing an http uri into a lane
+struct lane_uri {
+    TAILQ_ENTRY(lane_uri)        next;
+    char                         *uri;        // uri
+    struct lane                  *lane;       // lane for this uri
 };
 
 // system settings for the stats proxy (internal uris)
@@ -91,6 +163,10 @@ typedef struct {
     char                         *reporterAddr;
     int                          reporterPort;
     TAILQ_HEAD(system_uri_entries, confed_uri) uris; // system uris
+    struct lane                  lanes[NUM_LANES];   // request lanes
+    int                          history_hours;      // stat history kept
+    char                         *state_file;        // saved state (or NULL)
+    TAILQ_HEAD(lane_uri_entries, lane_uri) laneUris; // lane overrides
 } system_statsproxy_settings_t;
 
 // global settings for the stats proxy
@@ -114,10 +190,14 @@ typedef struct {
     uint32_t                     backaddr;          // backend address
     uint16_t                     backport;          // backend port
     int                          pollfreq_ms;       // poll frequency in ms
+    int                          poll_jitter;       // poll phase spread in %
     int                          refreshfreq_ms;    // webpage refresh frequency in ms
     int                          connect_ms;        // connect timeout in ms
     int                          read_ms;           // read timeout in ms
     int                          write_ms;          // write timeout in ms
+    char                         *pool;             // pool tag (clusters)
+    char                         *health_key;       // health probe key
+    int                          health_value_size; // health probe value bytes
     // memcache reporter settings
     char                         *reporter;     // "off" | "view" | "modify"
     TAILQ_HEAD(local_uri_entries, confed_uri) uris; // local uris
@@ -131,25 +211,127 @@ typedef union {
 } stats_type_t;
 
 struct stats_entry {
-    TAILQ_ENTRY(stats_entry)     next;
     enum stats_type              type;         // type of stat
-    const char                   *name;        // name
+    int                          known;        // schema slot, or -1
+    uint32_t                     id;           // interned name number
+    int                          slab;         // slab class in the matrix, or -1
+    const char                   *name;        // name (interned)
     stats_type_t                 v;            // value
 };
-TAILQ_HEAD(stats_entries, stats_entry);
 
-struct stats_entry *
-newStatEntry(const char *name, enum stats_type type, char *strVal, uint64_t val);
+// per slab stats ("items:<class>:<field>" in "stats items",
+// "<class>:<field>" in "stats slabs") as a dense slab class x field matrix
+// of numbers, one contiguous column per field: the value of field f in row
+// r is vals[f * nslabs + r], when have[f * nslabs + r] is set
+#define MAX_SLAB_CLASSES  256
+#define MAX_SLAB_FIELDS   64
+#define SLAB_ITEMS_PREFIX "items:"
+
+struct slab_matrix {
+    int                          nslabs;       // rows
+    int                          nfields;      // columns
+    const char                   *prefix;      // stat name prefix ("items:")
+    int                          *slab;        // slab class of each row
+    const char                   **field;      // field name of each column
+    uint64_t                     *vals;        // values, column by column
+    uint8_t                      *have;        // value present
+};
+
+// the column of a field, or -1
+int slab_field(struct slab_matrix *m, const char *field);
+
+// a field summed over the slab classes
+uint64_t slab_total(struct slab_matrix *m, int f);
+
+// one uri's stats from one poll in a single allocation: the entries in
+// reply order, an index of them sorted by name, then the string arena
+// their string values point into (names are interned, see intern.h).
+// Released with one free().
+// Known stats are also found by schema slot, their counters and gauges
+// already numbers.
+struct stats_snapshot {
+    int                          count;        // number of stats
+    struct stats_entry           **index;      // entries sorted by name
+    struct stats_entry           *known[NUM_KNOWN_STATS]; // by schema slot
+    struct slab_matrix           *slabs;       // per slab stats, or NULL
+    struct stats_entry           entries[1];   // entries in reply order
+};
+
+// a snapshot being put together - names are interned and string values
+// copied into a growing arena, kept as offsets until the snapshot is laid
+// out. A zeroed builder is empty; it keeps its buffers from one snapshot
+// to the next.
+struct stats_slot {
+    enum stats_type              type;
+    uint32_t                     id;           // interned name number
+    const char                   *name;        // interned name
+    int                          slab;         // slab class, or -1
+    const char                   *field;       // interned slab field
+    size_t                       str;          // arena offset of the value
+    uint64_t                     value;
+};
+
+struct stats_builder {
+    struct stats_slot            *slots;       // stats so far
+    int                          count;
+    int                          size;
+    char                         *arena;       // their strings
+    size_t                       used;
+    size_t                       arenaSize;
+};
+
+// add a stat (str for ALPHA stats, val for UINT64 ones) to the builder
+void stats_add(struct stats_builder *b, const char *name, enum stats_type type,
+               const char *str, uint64_t val);
+
+// drop the stats added so far
+void stats_discard(struct stats_builder *b);
+
+// lay the added stats out as a snapshot and empty the builder; the schema
+// slots are only bound for the general stats (general set)
+struct stats_snapshot *stats_finish(struct stats_builder *b, int general);
+
+// one serialized stats update, shared by every stream subscriber
+struct sse_event {
+    int                        refs;           // reference count
+    uint64_t                   generation;     // poll generation
+    size_t                     len;            // length of data
+    char                       *data;          // the event text
+};
+
+// the stats one publish changed, by position in reply order
+#define CHANGE_HISTORY 32
+struct change_map {
+    uint64_t                   generation;     // the publish
+    uint64_t                   *bits;          // one bit per stat
+};
 
 // one uri and its current stats values
 struct uri_entry {
     TAILQ_ENTRY(uri_entry)     next;
     char                       *uri;           // uri
     time_t                     lastpoll;       // time of last poll
+    int                        pollfreq_ms;    // own poll interval (or 0)
+    int                        interval_ms;    // current poll interval
+    uint64_t                   due_ms;         // when it's next polled
+    uint64_t                   cost_us;        // average poll round trip
+    uint64_t                   published_ms;   // when the stats were published
+    uint64_t                   generation;     // poll generation of stats
     callback_t                 cb;             // callback for this uri
-    struct stats_entries       stats;          // list of stats
+    struct stats_snapshot      *stats;         // the stats
+    struct stats_snapshot      *pending;       // this cycle's stats so far
+    int                        staged;         // pending awaits publishing
+    int                        unchanged;      // last reply was the same
+    uint64_t                   fingerprint;    // hash of the last reply
+    uint64_t                   changedFrom;    // changes known after this
+    int                        changeNext;     // next slot of changes
+    struct change_map          changes[CHANGE_HISTORY]; // recent publishes
+    struct sse_event           *event;         // cached stream update
 };
 
+// the general "stats" uri, the one the known stats schema describes
+#define GENERAL_URI(uri_entry) ((uri_entry)->uri[0] == '\0')
+
 enum backend_state { HALTED, CONNECTING, POLLING, FAULT };
 
 // each backend has a list of attached stats uris (such as "storage", "items")
@@ -162,7 +344,23 @@ struct backend {
     enum backend_state           state;
     int                          last_error;  // last reported error
     pthread_rwlock_t             rwlock;      // backend lock
+    uint64_t                     generation;  // published poll cycles
+    pthread_mutex_t              genLock;     // generation/event lock
+    pthread_cond_t               genCond;     // signalled every poll cycle
     struct settings              *config;     // ref for the complete config
+    struct cluster               *cluster;    // aggregation (cluster backends)
+    int                          slot;        // fleet ranking slot (or -1)
+    struct latency               *latency;    // latency sketches
+    uint64_t                     probes;      // health probes sent
+    int                          longest_ms;  // longest uri poll interval
+    int                          phase_ms;    // poll phase offset
+    struct timer                 timer;       // wakes the poller
+    struct history               *history;    // stat history (or NULL)
+    struct slab_analysis         *analysis;   // slab analysis (or NULL)
+    int                          warm;        // serving a restored snapshot
+    struct stats_builder         builder;     // the poller's next snapshot
+    char                         *reply;      // raw stats reply buffer
+    size_t                       reply_size;  // allocated reply buffer
     TAILQ_HEAD(uri_entries, uri_entry) uris;  // local uris + stats
 };
 
@@ -175,32 +373,93 @@ void rdlock(backend_t *bep);
 void wrlock(backend_t *bep);
 void unlock(backend_t *bep);
 
+// lay out the builder's stats as a uri's new snapshot and hold it for the
+// next publishCycle() (poller thread only)
+void stageStats(struct uri_entry *uri_entry, struct stats_builder *b);
+
+// swap in every staged uri at once and wake up the stream subscribers
+void publishCycle(backend_t *bep);
+
+// put back a uri's stats saved by an earlier run (before polling starts)
+void restoreStats(struct uri_entry *uri_entry, struct stats_builder *b,
+                  uint64_t generation, uint64_t published_ms);
+
+// stats a request asked for ("stats items items:1:number items:12:*", or
+// "?stat=...&prefix=..." on the web) - names, prefixes or glob patterns
+#define MAXSTATARGS 64
+enum stat_match { MATCH_NAME, MATCH_PREFIX, MATCH_GLOB };
+typedef struct {
+    int                        count;                // number of names
+    char                       *names[MAXSTATARGS];  // names or patterns
+    enum stat_match            match[MAXSTATARGS];   // how to match them
+    char                       buf[MAXREQSZ];        // storage for names
+    int                        hasSince;             // changes only
+    uint64_t                   since;                // after this generation
+} stat_filter_t;
+
 // frontend client types
 enum client_type { MEMCACHE_CLIENT, HTTP_CLIENT };
 typedef struct {
     int                        fd;          // client fd
-    FILE                       *fp;         // FILE * for fd
+    FILE                       *fp;         // FILE * writing fd
+    FILE                       *in;         // FILE * reading fd
     backend_t                  *bep;        // backend
     enum client_type           type;        // memcache or http */
+    struct sockaddr_in         addr;        // client address
+    char                       method[16];  // request method
+    FILE                       *sock;       // socket under a chunked body
+    int                        http11;      // HTTP/1.1 client
+    int                        keepAlive;   // connection stays open
+    int                        framed;      // response has a known end
+    stat_filter_t              filter;      // stats (or keys) asked for
 } proxyclient_t;
 
 typedef int bool_t;
 
 // setting parser declarations
-void addGlobalUri(global_statsproxy_settings_t *global, char *uri);
-void addLocalUri(local_statsproxy_settings_t *local, char *uri);
+void addGlobalUri(global_statsproxy_settings_t *global, char *uri,
+                  int pollfreq_ms);
+void addLocalUri(local_statsproxy_settings_t *local, char *uri,
+                 int pollfreq_ms);
 
 struct settings {
     system_statsproxy_settings_t    sys;
     global_statsproxy_settings_t    global;
     local_statsproxy_settings_t     local;
     struct backend_entries          proxies;
+    struct backend_entries          clusters;
 };
 
 void addProxy(struct settings *settings);
+void addCluster(struct settings *settings);
 
 #define CMDSZ 64
 
+// every stats uri of a backend from one poll cycle
+#define ALL_URI "all"
+
+// fleet ranking of the backends by a stat ("top?stat=evictions:rate&n=5")
+#define TOP_URI "top"
+
+// latency percentiles per backend, pool and fleet ("latency?minutes=10")
+#define LATENCY_URI "latency"
+#define DEFAULT_LATENCY_MINUTES 10
+
+// a stat's history over a time range ("history?stat=<uri>:<name>")
+#define HISTORY_URI "history"
+
+// memory efficiency of a backend's slab classes
+#define SLAB_ANALYSIS_URI "slab-analysis"
+
+// one stats uri of every backend ("fleet/<uri>" on the web)
+#define FLEET_URI "fleet"
+
+// suffix of the server-sent events stream of a stats uri
+#define EVENTS_URI "events"
+
+// key prefix for memcache "get" of a single stat - "stat:<uri>:<name>"
+#define STAT_KEY_PREFIX "stat:"
+
 // Response codes */
 #define HTTP_OK            200
 #define HTTP_NOCONTENT     204
@@ -210,6 +469,7 @@ void addProxy(struct settings *settings);
 #define HTTP_NOTMODIFIED   304
 #define HTTP_BADREQUEST    400
 #define HTTP_NOTFOUND      404
+#define HTTP_TOOMANY       429
 #define HTTP_SERVUNAVAIL   503
 
 #define HTTP_MAJOR         1
@@ -301,8 +561,13 @@ struct sp_memcache_socket_state {
 int sp_memcache_read(backend_t *bep, char *data, int len, 
                        struct sp_memcache_socket_state *sk_state, bool_t *done);
              
-// parse data received from the server
-int sp_memcache_read_replies(backend_t *bep, struct stats_entries *stats);
+// parse data received from the server - nothing is parsed when the raw
+// reply hashes to *fingerprint, the previous reply's, and *unchanged is set
+int sp_memcache_read_replies(backend_t *bep, struct stats_builder *b,
+                             uint64_t *fingerprint, bool_t *unchanged);
+
+// FNV-1a hash of a buffer
+uint64_t fnv1a(const void *data, size_t len);
 
 // indicate an "expected" exit - used for reconfigs that need a restart
 #define EXIT_RECONFIGURE                72
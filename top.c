@@ -0,0 +1,312 @@
+// ========================================================================
+//
+//  Project   : statsproxy 
+//
+//  Version   : 1.0
+//
+//  Copyright :
+//
+//      Software License Agreement (BSD License)
+//
+//      Copyright (c) 2009, Gear Six, Inc.
+//      All rights reserved.
+//
+//      Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are
+//      met:
+//
+//      * Redistributions of source code must retain the above copyright
+//        notice, this list of conditions and the following disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following disclaimer
+//        in the documentation and/or other materials provided with the
+//        distribution.
+//
+//      * Neither the name of Gear Six, Inc. nor the names of its
+//        contributors may be used to endorse or promote products derived from
+//        this software without specific prior written permission.The Gear Six logo, 
+//        which is provided in the source code and appears on the user interface 
+//        to identify Gear Six, Inc. as the originator of the software program, is 
+//        a trademark of Gear Six, Inc. and can be used only in unaltered form and 
+//        only for purposes of such identification.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// ========================================================================
+//
+#include <stdio.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "queue.h"
+#include "statsproxy.h"
+#include "proxylog.h"
+#include "top.h"
+
+// backends that haven't published for this many of their longest uri poll
+// intervals are left out of the rankings
+#define TOP_STALE_POLLS 3
+
+// one stat across the fleet - a contiguous value per backend slot, so a
+// ranking is a single pass of partial selection over the column
+struct top_column {
+    char                       *name;          // stat name
+    uint64_t                   *vals;          // value per backend
+    double                     *rates;         // per second rate per backend
+    uint64_t                   *stamp;         // publish time per backend
+};
+
+static pthread_rwlock_t  topLock = PTHREAD_RWLOCK_INITIALIZER;
+static int               nslots;               // number of backends
+static backend_t         **slots;              // backend per slot
+static int               ncols;                // number of columns
+static int               colsSize;             // size of cols
+static struct top_column **cols;               // columns sorted by name
+static uint32_t          nids;                 // size of idCols
+static struct top_column **idCols;             // columns by interned name
+
+void
+top_init(struct backend_entries *proxies)
+{
+    backend_t *bep;
+
+    TAILQ_FOREACH(bep, proxies, next) {
+        nslots++;
+    }
+    slots = (backend_t **) calloc(nslots + 1, sizeof *slots);
+    alloc_fail_check(slots);
+    nslots = 0;
+    TAILQ_FOREACH(bep, proxies, next) {
+        bep->slot = nslots;
+        slots[nslots++] = bep;
+    }
+}
+
+// binary search for a column; *pos is where it would go when missing
+static struct top_column *
+findColumn(const char *name, int *pos)
+{
+    int lo = 0;
+    int hi = ncols;
+    int mid;
+    int cmp;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        cmp = strcmp(cols[mid]->name, name);
+        if (cmp == 0) {
+            *pos = mid;
+            return cols[mid];
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *pos = lo;
+    return NULL;
+}
+
+static struct top_column *
+addColumn(const char *name, int pos)
+{
+    struct top_column *col;
+
+    if (ncols == colsSize) {
+        colsSize = colsSize ? colsSize * 2 : 256;
+        cols = (struct top_column **) realloc(cols, colsSize * sizeof *cols);
+        alloc_fail_check(cols);
+    }
+    col = (struct top_column *) calloc(1, sizeof *col);
+    alloc_fail_check(col);
+    col->name = strdup(name);
+    alloc_fail_check(col->name);
+    col->vals = (uint64_t *) calloc(nslots + 1, sizeof *col->vals);
+    alloc_fail_check(col->vals);
+    col->rates = (double *) calloc(nslots + 1, sizeof *col->rates);
+    alloc_fail_check(col->rates);
+    col->stamp = (uint64_t *) calloc(nslots + 1, sizeof *col->stamp);
+    alloc_fail_check(col->stamp);
+    memmove(&cols[pos + 1], &cols[pos], (ncols - pos) * sizeof *cols);
+    cols[pos] = col;
+    ncols++;
+    return col;
+}
+
+// remember a column under its stat's interned name number
+static void
+idColumn(uint32_t id, struct top_column *col)
+{
+    uint32_t size = nids;
+
+    if (id >= nids) {
+        while (size <= id) {
+            size = size ? size * 2 : 1024;
+        }
+        idCols = (struct top_column **) realloc(idCols, size * sizeof *idCols);
+        alloc_fail_check(idCols);
+        memset(&idCols[nids], 0, (size - nids) * sizeof *idCols);
+        nids = size;
+    }
+    idCols[id] = col;
+}
+
+void
+top_update(backend_t *bep, uint64_t now)
+{
+    struct uri_entry   *uri_entry;
+    struct stats_entry *entry;
+    struct top_column  *col;
+    const char         *str;
+    uint64_t           val;
+    uint64_t           dt;
+    size_t             len;
+    int                pos;
+    int                i;
+    int                slot = bep->slot;
+
+    if (slot < 0) {
+        return; // clusters aren't ranked
+    }
+    pthread_rwlock_wrlock(&topLock);
+    TAILQ_FOREACH(uri_entry, &bep->uris, next) {
+        if (uri_entry->published_ms != now) {
+            continue; // not polled this cycle
+        }
+        for (i = 0; i < uri_entry->stats->count; i++) {
+            entry = &uri_entry->stats->entries[i];
+            if (entry->type == UINT64) {
+                val = entry->v.value;
+            } else {
+                str = entry->v.valueStr;
+                len = strspn(str, "0123456789");
+                if (len == 0 || len >= 20 || str[len] != '\0') {
+                    continue;
+                }
+                val = strtoull(str, NULL, 10);
+            }
+            col = (entry->id < nids) ? idCols[entry->id] : NULL;
+            if (col == NULL) {
+                col = findColumn(entry->name, &pos);
+                if (col == NULL) {
+                    col = addColumn(entry->name, pos);
+                }
+                idColumn(entry->id, col);
+            }
+            dt = now - col->stamp[slot];
+            if (col->stamp[slot] != 0 && dt > 0 && val >= col->vals[slot]) {
+                col->rates[slot] = (double) (val - col->vals[slot]) *
+                                   NUM_MSECS_PER_SEC / dt;
+            } else {
+                col->rates[slot] = 0;
+            }
+            col->vals[slot] = val;
+            col->stamp[slot] = now;
+        }
+    }
+    pthread_rwlock_unlock(&topLock);
+}
+
+// partial selection - move the n largest values to the front (unordered)
+static void
+selectTop(struct top_entry *e, int count, int n)
+{
+    struct top_entry tmp;
+    int              lo = 0;
+    int              hi = count - 1;
+    int              i;
+    int              store;
+    double           pivot;
+
+    while (lo < hi) {
+        i = lo + (hi - lo) / 2;
+        pivot = e[i].value;
+        tmp = e[i]; e[i] = e[hi]; e[hi] = tmp;
+        store = lo;
+        for (i = lo; i < hi; i++) {
+            if (e[i].value > pivot) {
+                tmp = e[i]; e[i] = e[store]; e[store] = tmp;
+                store++;
+            }
+        }
+        tmp = e[store]; e[store] = e[hi]; e[hi] = tmp;
+        if (store == n - 1 || store == n) {
+            return;
+        } else if (store < n) {
+            lo = store + 1;
+        } else {
+            hi = store - 1;
+        }
+    }
+}
+
+static int
+compareTop(const void *a, const void *b)
+{
+    const struct top_entry *ea = (const struct top_entry *) a;
+    const struct top_entry *eb = (const struct top_entry *) b;
+
+    return (ea->value < eb->value) - (ea->value > eb->value);
+}
+
+int
+top_query(const char *stat, int n, uint64_t now, struct top_entry *top)
+{
+    struct top_column *col;
+    struct top_entry  *all;
+    char              name[MAXREQSZ];
+    size_t            len = strlen(stat);
+    size_t            suffix = strlen(TOP_RATE_SUFFIX);
+    bool_t            rate = FALSE;
+    uint64_t          stale;
+    int               count = 0;
+    int               pos;
+    int               i;
+
+    if (len > suffix && strcmp(stat + len - suffix, TOP_RATE_SUFFIX) == 0) {
+        len -= suffix;
+        rate = TRUE;
+    }
+    snprintf(name, sizeof name, "%.*s", (int) len, stat);
+
+    all = (struct top_entry *) calloc(nslots + 1, sizeof *all);
+    alloc_fail_check(all);
+    pthread_rwlock_rdlock(&topLock);
+    col = findColumn(name, &pos);
+    for (i = 0; col != NULL && i < nslots; i++) {
+        stale = (uint64_t) slots[i]->longest_ms * TOP_STALE_POLLS;
+        if (col->stamp[i] == 0 || now - col->stamp[i] > stale) {
+            continue;
+        }
+        all[count].bep = slots[i];
+        all[count].value = rate ? col->rates[i] : (double) col->vals[i];
+        count++;
+    }
+    pthread_rwlock_unlock(&topLock);
+
+    n = (n < count) ? n : count;
+    if (n > 0 && n < count) {
+        selectTop(all, count, n);
+    }
+    qsort(all, n, sizeof *all, compareTop);
+    memcpy(top, all, n * sizeof *top);
+    free(all);
+    return n;
+}
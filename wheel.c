@@ -0,0 +1,227 @@
+// ========================================================================
+//
+//  Project   : statsproxy 
+//
+//  Version   : 1.0
+//
+//  Copyright :
+//
+//      Software License Agreement (BSD License)
+//
+//      Copyright (c) 2009, Gear Six, Inc.
+//      All rights reserved.
+//
+//      Redistribution and use in source and binary forms, with or without
+//      modification, are permitted provided that the following conditions are
+//      met:
+//
+//      * Redistributions of source code must retain the above copyright
+//        notice, this list of conditions and the following disclaimer.
+//
+//      * Redistributions in binary form must reproduce the above
+//        copyright notice, this list of conditions and the following disclaimer
+//        in the documentation and/or other materials provided with the
+//        distribution.
+//
+//      * Neither the name of Gear Six, Inc. nor the names of its
+//        contributors may be used to endorse or promote products derived from
+//        this software without specific prior written permission.The Gear Six logo, 
+//        which is provided in the source code and appears on the user interface 
+//        to identify Gear Six, Inc. as the originator of the software program, is 
+//        a trademark of Gear Six, Inc. and can be used only in unaltered form and 
+//        only for purposes of such identification.
+//
+//      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// ========================================================================
+//
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "queue.h"
+#include "statsproxy.h"
+#include "proxylog.h"
+#include "wheel.h"
+
+TAILQ_HEAD(timer_list, timer);
+
+static pthread_once_t   wheelOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t  wheelLock = PTHREAD_MUTEX_INITIALIZER;
+static struct timer_list slots[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint64_t         current;     // next tick to run
+
+static uint64_t
+monotonicUs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t
+wheel_now(void)
+{
+    return monotonicUs() / 1000;
+}
+
+// the slot of a timer's level the tick falls into
+static int
+slotOf(uint64_t tick, int level)
+{
+    return (int) ((tick >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1));
+}
+
+// hang a timer on the level whose span takes in its expiry (lock held)
+static void
+place(struct timer *t)
+{
+    uint64_t span = (uint64_t) 1 << (WHEEL_LEVELS * WHEEL_BITS);
+    uint64_t when;
+    int      level;
+
+    if (t->expires < current) {
+        t->expires = current; // overdue - the next tick
+    }
+    when = t->expires;
+    if (when - current >= span) {
+        // beyond the wheel - cascades down to be placed afresh
+        when = current + span - 1;
+    }
+    for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+        if (when - current < ((uint64_t) 1 << ((level + 1) * WHEEL_BITS))) {
+            break;
+        }
+    }
+    TAILQ_INSERT_TAIL(&slots[level][slotOf(when, level)], t, next);
+}
+
+// move the timers of a slot one level down, returning the slot (lock held)
+static int
+cascade(int level)
+{
+    struct timer_list list;
+    struct timer      *t;
+    int               slot = slotOf(current, level);
+
+    TAILQ_INIT(&list);
+    while ((t = TAILQ_FIRST(&slots[level][slot])) != NULL) {
+        TAILQ_REMOVE(&slots[level][slot], t, next);
+        TAILQ_INSERT_TAIL(&list, t, next);
+    }
+    while ((t = TAILQ_FIRST(&list)) != NULL) {
+        TAILQ_REMOVE(&list, t, next);
+        place(t);
+    }
+    return slot;
+}
+
+// run one tick: cascade when the lowest level wraps, then wake the
+// sleepers of the tick's slot (lock held)
+static void
+tick(void)
+{
+    struct timer *t;
+    int          slot = slotOf(current, 0);
+    int          level;
+
+    if (slot == 0) {
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            if (cascade(level) != 0) {
+                break;
+            }
+        }
+    }
+    while ((t = TAILQ_FIRST(&slots[0][slot])) != NULL) {
+        TAILQ_REMOVE(&slots[0][slot], t, next);
+        t->fired = TRUE;
+        pthread_cond_signal(&t->cond);
+    }
+    current++;
+}
+
+// the wheel thread - catches up with the clock, then sleeps to the next tick
+static void *
+wheelRun(void *arg)
+{
+    struct timespec ts;
+    uint64_t        next;
+
+    for (;;) {
+        pthread_mutex_lock(&wheelLock);
+        while (current <= wheel_now() / WHEEL_TICK_MS) {
+            tick();
+        }
+        next = current * WHEEL_TICK_MS;
+        pthread_mutex_unlock(&wheelLock);
+
+        ts.tv_sec = next / 1000;
+        ts.tv_nsec = (next % 1000) * 1000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                               NULL) == EINTR) {
+            continue;
+        }
+    }
+    return NULL;
+}
+
+static void
+wheelStart(void)
+{
+    pthread_t thr;
+    int       level;
+    int       slot;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < WHEEL_SLOTS; slot++) {
+            TAILQ_INIT(&slots[level][slot]);
+        }
+    }
+    current = wheel_now() / WHEEL_TICK_MS;
+    pthread_create(&thr, NULL, wheelRun, NULL);
+    pthread_detach(thr);
+}
+
+void
+timer_init(struct timer *t)
+{
+    memset(t, 0, sizeof *t);
+    pthread_cond_init(&t->cond, NULL);
+}
+
+uint64_t
+wheel_sleep(struct timer *t, uint64_t deadline)
+{
+    uint64_t late;
+
+    pthread_once(&wheelOnce, wheelStart);
+
+    pthread_mutex_lock(&wheelLock);
+    // the first tick that starts at or after the deadline
+    t->expires = (deadline + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    t->fired = FALSE;
+    place(t);
+    while (!t->fired) {
+        pthread_cond_wait(&t->cond, &wheelLock);
+    }
+    pthread_mutex_unlock(&wheelLock);
+
+    late = monotonicUs();
+    return (late > deadline * 1000) ? late - deadline * 1000 : 0;
+}